@@ -1,72 +1,2545 @@
 /*
  * The Buddy Page Allocator
- * SKELETON IMPLEMENTATION TO BE FILLED IN FOR TASK 2
+ *
+ * Hands out naturally aligned blocks of 2^order pages from doubly linked free lists, one set per
+ * memory node, order and mobility type, and coalesces freed blocks with their buddies.  The
+ * order of every free and allocated block is recorded per page, so a buddy is checked with one
+ * read and a bad free is caught before it corrupts anything.  Each order has its own lock.
+ *
+ * Around the core sit an optional per-CPU order-0 cache, bulk, near, contiguous and zeroed
+ * allocations, a huge page pool, hot-add and removal of memory, watermarks with shrinkers and a
+ * reclaim daemon, and compaction through a registered page migrator.  buddy.h is the interface
+ * the rest of the kernel uses; tests/ builds this file on the host against stand-in headers.
  */
 
 #include <infos/mm/page-allocator.h>
 #include <infos/mm/mm.h>
 #include <infos/kernel/kernel.h>
 #include <infos/kernel/log.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/process.h>
+#include <infos/kernel/thread.h>
+#include <infos/kernel/sched-entity.h>
 #include <infos/util/math.h>
 #include <infos/util/printf.h>
+#include <infos/util/string.h>
+#include <infos/util/lock.h>
+
+#include "buddy.h"
 
 using namespace infos::kernel;
 using namespace infos::mm;
 using namespace infos::util;
 
-#define MAX_ORDER	18
+/*
+ * The largest order of the standard allocator, and the largest any variant of it may be built
+ * with: the tables the variants share are sized for it.
+ */
+#define MAX_ORDER	18
+
+/*
+ * The number of page frames the buddy metadata is sized for: 8 GiB worth of 4 KiB pages, which
+ * covers the 6G guest that run.sh boots.  Frames beyond this are left unmanaged.
+ */
+#define MAX_PFNS	(1ul << 21)
+
+/* The most free blocks or runs dump_state() copies out under the locks at a time. */
+#define DUMP_CHUNK	32
+
+/* The back-link of a block at the head of its free list. */
+#define NO_PFN	0xffffffffu
+
+/* The free order recorded for a page that does not head a free block. */
+#define NOT_FREE	0xff
+
+/* The allocated order recorded for the head of a run from allocate_contiguous(). */
+#define CONTIGUOUS_RUN	0xfe
+
+/* The allocated order recorded for the head of a block while compaction is migrating it. */
+#define MIGRATING	0xfd
+
+/*
+ * The allocated order recorded for the head of every page in the huge page pool, free or not,
+ * so that pool pages and buddy blocks can only be freed back to where they came from.
+ */
+#define HUGE_PAGE	0xfc
+
+/*
+ * What next_free holds in the head of an allocated block.  Freeing anything else is a double
+ * free or a bad pointer, and the address is non-canonical, so anything following it faults.
+ */
+#define ALLOCATED_POISON	((PageDescriptor *)0xdead000000000100ul)
+
+/* What a daemon's thread pointer holds while the thread is being created. */
+#define DAEMON_STARTING	((Thread *)1)
+
+/*
+ * Free memory is grouped by mobility at pageblock granularity: each 2^PAGEBLOCK_ORDER page
+ * (2 MiB) pageblock has a mobility type, and its free blocks sit on that type's free lists.
+ */
+#define PAGEBLOCK_ORDER	9
+
+/* Allocations of at least this order (2 MiB) try compaction before giving up. */
+#define COMPACTION_ORDER	9
+
+/*
+ * The most pages an allocation will wait to have migrated for it.  Regions that need more are
+ * left to the compaction daemon.
+ */
+#define COMPACTION_SYNC_MAX_PAGES	256
+
+/* The order of the blocks in the huge page pool (2 MiB). */
+#define HUGE_PAGE_ORDER	9
+
+/*
+ * The zeroing daemon keeps ZERO_POOL_PAGES worth of pre-zeroed blocks ready for each order up to
+ * ZERO_POOL_MAX_ORDER.
+ */
+#define ZERO_POOL_MAX_ORDER	4
+#define ZERO_POOL_PAGES	512u
+
+/*
+ * Per-CPU page cache geometry: order-0 pages move between the cache and the buddy lists
+ * PCP_BATCH at a time, and the cache is drained once it holds more than PCP_HIGH pages.
+ */
+#define PCP_BATCH	32
+#define PCP_HIGH	(4 * PCP_BATCH)
+
+/*
+ * Free memory watermarks: the min watermark is 1/WATERMARK_MIN_RATIO of all pages, and low and
+ * high sit a quarter and a half again above it.  Dropping below low wakes the reclaim daemon,
+ * which works until free memory is back above high; dropping below min makes the allocating
+ * thread reclaim for itself.
+ */
+#define WATERMARK_MIN_RATIO	256
+
+/* The most shrink callbacks that can be registered at once. */
+#define MAX_SHRINKERS	8
+
+/*
+ * The most memory nodes the allocator keeps separate free areas for.  Nodes are contiguous,
+ * power-of-two sized and at least a MAX_ORDER block long, so buddies never straddle two nodes.
+ */
+#define MAX_NODES	8
+
+/*
+ * The space for the per-order bitmaps of free blocks.  Between them, the bitmaps of every order
+ * take under two bits per page, plus a word of rounding each.
+ */
+#define FREE_BITMAP_WORDS	((2 * MAX_PFNS) / 64 + MAX_ORDER + 1)
+#define FREE_BITMAP_SUMMARY_WORDS	(FREE_BITMAP_WORDS / 64 + MAX_ORDER + 1)
+
+/** Reads the time-stamp counter, for cycle counts in the boot-time log messages. */
+static inline uint64_t rdtsc()
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static bool pgalloc_pcp;
+
+RegisterCmdLineArgument(PageAllocPCP, "pgalloc.pcp") {
+	pgalloc_pcp = strncmp(value, "1", 1) == 0;
+}
+
+static bool pgalloc_debug;
+
+RegisterCmdLineArgument(PageAllocDebug, "pgalloc.debug") {
+	pgalloc_debug = strncmp(value, "1", 1) == 0;
+}
+
+static unsigned int pgalloc_nodes = 1;
+
+RegisterCmdLineArgument(PageAllocNodes, "pgalloc.nodes") {
+	if (value[0] >= '1' && value[0] <= '0' + MAX_NODES) {
+		pgalloc_nodes = value[0] - '0';
+	}
+}
+
+static uint64_t pgalloc_hugepages;
+
+RegisterCmdLineArgument(PageAllocHugePages, "pgalloc.hugepages") {
+	pgalloc_hugepages = 0;
+	for (const char *digit = value; *digit >= '0' && *digit <= '9'; digit++) {
+		pgalloc_hugepages = pgalloc_hugepages * 10 + (*digit - '0');
+	}
+}
+
+static bool pgalloc_check;
+
+RegisterCmdLineArgument(PageAllocCheck, "pgalloc.check") {
+	pgalloc_check = strncmp(value, "1", 1) == 0;
+}
+
+static bool pgalloc_dump_compact;
+
+RegisterCmdLineArgument(PageAllocDump, "pgalloc.dump") {
+	pgalloc_dump_compact = strncmp(value, "compact", 7) == 0;
+}
+
+/*
+ * With pgalloc.ordered=1, every allocation takes the lowest-addressed free block that fits on
+ * its node, rather than the most recently freed one, so that allocations pack into low memory
+ * and high memory is left in large blocks.  Grouping by mobility type goes by the wayside.  This
+ * turns any variant of the allocator into an address-ordered one.
+ */
+static bool pgalloc_ordered;
+
+RegisterCmdLineArgument(PageAllocOrdered, "pgalloc.ordered") {
+	pgalloc_ordered = strncmp(value, "1", 1) == 0;
+}
+
+/* The number of events the trace ring holds before it starts overwriting the oldest. */
+#define TRACE_RING_SIZE	4096
+
+/* The port QEMU's -debugcon device listens on. */
+#define DEBUGCON_PORT	0xe9
+
+enum TraceEventType
+{
+	TRACE_ALLOCATE,
+	TRACE_FREE,
+	TRACE_SPLIT,
+	TRACE_MERGE,
+};
+
+static const char *trace_event_names[] = { "alloc", "free", "split", "merge" };
+
+/**
+ * One allocator event, as recorded in the trace ring.  Kept to 32 bytes, so two fit in a cache
+ * line.
+ */
+struct TraceEvent
+{
+	uint64_t tsc;		// when the event finished
+	uint64_t caller;	// return address of the allocator entry point that caused it
+	uint32_t pfn;		// the block involved, or NO_PFN for a failed allocation
+	uint32_t cycles;	// how long an allocate or free took; zero for splits and merges
+	uint8_t type;
+	uint8_t order;
+	uint8_t reserved[6];
+};
+
+/**
+ * A ring of the most recent allocator events.  Writers claim a slot with an atomic increment
+ * of the head, so recording never takes a lock.
+ */
+struct TraceRing
+{
+	uint64_t head;
+	TraceEvent events[TRACE_RING_SIZE];
+};
+
+/**
+ * Formats an event as the "pgtrace" line decode-pgtrace.sh reads:
+ * "pgtrace <tsc> <type> <pfn> <order> <cycles> <caller>", with the numbers in hex but for the
+ * order and cycles.
+ */
+static void format_trace_event(const TraceEvent& event, char *line, size_t size)
+{
+	snprintf(line, size, "pgtrace %lx %s %x %u %u %lx\n",
+		event.tsc, trace_event_names[event.type], event.pfn, event.order, event.cycles, event.caller);
+}
+
+static const char *mobility_names[NR_FREE_LIST_TYPES] = { "unmovable", "reclaimable", "movable", "isolate" };
+
+/**
+ * Which free block of the right size an allocation takes.
+ */
+enum FreeListPolicy
+{
+	FREE_LIST_LIFO,			// the most recently freed, which is most likely still in the CPU cache
+	FREE_LIST_FIFO,			// the least recently freed
+	FREE_LIST_ADDRESS_ORDERED,	// the lowest-addressed, which keeps high memory in large blocks
+};
+
+static const char *free_list_policy_names[] = { "lifo", "fifo", "address-ordered" };
+
+/* The other types' free lists to raid, in order, when a type has run dry. */
+static const PageMobility mobility_fallbacks[NR_MOBILITY_TYPES][NR_MOBILITY_TYPES - 1] = {
+	{ MOBILITY_RECLAIMABLE, MOBILITY_MOVABLE },	// unmovable
+	{ MOBILITY_UNMOVABLE, MOBILITY_MOVABLE },	// reclaimable
+	{ MOBILITY_RECLAIMABLE, MOBILITY_UNMOVABLE },	// movable
+};
+
+/**
+ * Buddy-private state kept alongside each page descriptor, as PageDescriptor itself only carries
+ * next_free.  It is only meaningful for the head page of a block.  Everything the free and merge
+ * paths look at for a block sits in these eight bytes, so checking a buddy is a single read.
+ */
+struct FreeBlockInfo
+{
+	uint32_t prev_free;	// PFN of the previous block on the free list, or NO_PFN; the length of a contiguous run
+	uint8_t order;		// order of the free block, or NOT_FREE
+	uint8_t mobility;	// mobility type of the free list the block is on
+	uint8_t alloc_order;	// order of the allocated block, CONTIGUOUS_RUN, or NOT_FREE
+};
+
+/**
+ * A bitmap with a summary bit for every word of it, so that the set bit nearest to any index can
+ * be found without testing every word in between.
+ */
+class BlockBitmap
+{
+public:
+	/**
+	 * Points the bitmap at its storage, and clears all of it.
+	 * @param words Storage for max_bits bits, rounded up to whole words.
+	 * @param summary Storage for one bit per word of that, rounded up to whole words.
+	 * @param max_bits The number of bits the bitmap can grow to.
+	 * @param nr_bits The number of bits in the bitmap to start with.
+	 */
+	void init(uint64_t *words, uint64_t *summary, uint64_t max_bits, uint64_t nr_bits)
+	{
+		_words = words;
+		_summary = summary;
+
+		for (uint64_t i = 0; i < words_for(max_bits); i++) _words[i] = 0;
+		for (uint64_t i = 0; i < words_for(words_for(max_bits)); i++) _summary[i] = 0;
+
+		grow(nr_bits);
+	}
+
+	/**
+	 * Extends the bitmap.  The storage behind it is already clear, so the new bits start out clear.
+	 * @param nr_bits The new number of bits, which must be no more than the bitmap can grow to.
+	 */
+	void grow(uint64_t nr_bits)
+	{
+		_nr_bits = nr_bits;
+		_nr_words = words_for(nr_bits);
+		_nr_summary_words = words_for(_nr_words);
+	}
+
+	/** Returns the number of words it takes to hold the given number of bits. */
+	static inline uint64_t words_for(uint64_t nr_bits) { return (nr_bits + 63) / 64; }
+
+	inline bool test(uint64_t index) const
+	{
+		return _words[index / 64] & (1ull << (index % 64));
+	}
+
+	inline void set(uint64_t index)
+	{
+		_words[index / 64] |= 1ull << (index % 64);
+		_summary[index / 4096] |= 1ull << (index / 64 % 64);
+	}
+
+	inline void clear(uint64_t index)
+	{
+		uint64_t& word = _words[index / 64];
+
+		word &= ~(1ull << (index % 64));
+		if (!word) _summary[index / 4096] &= ~(1ull << (index / 64 % 64));
+	}
+
+	/** Returns the number of set bits. */
+	uint64_t count() const
+	{
+		uint64_t nr_set = 0;
+		for (uint64_t i = 0; i < _nr_words; i++) nr_set += __builtin_popcountll(_words[i]);
+
+		return nr_set;
+	}
+
+	/**
+	 * Finds the first set bit at or after an index.
+	 * @param index The index to start from, which receives the index of the set bit.
+	 * @return Returns TRUE if there is a set bit, FALSE otherwise.
+	 */
+	bool find_next(uint64_t& index) const
+	{
+		if (index >= _nr_bits) return false;
+
+		uint64_t w = index / 64;
+		uint64_t bits = _words[w] & (~0ull << (index % 64));
+
+		if (!bits) {
+			// Nothing more in this word, so let the summary find the next word with anything in it.
+			w++;
+
+			uint64_t s = w / 64;
+			if (s >= _nr_summary_words) return false;
+
+			uint64_t summary = _summary[s] & (~0ull << (w % 64));
+			while (!summary) {
+				if (++s >= _nr_summary_words) return false;
+				summary = _summary[s];
+			}
+
+			w = s * 64 + __builtin_ctzll(summary);
+			bits = _words[w];
+		}
+
+		index = w * 64 + __builtin_ctzll(bits);
+		return true;
+	}
+
+	/**
+	 * Finds the last set bit at or before an index.
+	 * @param index The index to start from, which receives the index of the set bit.
+	 * @return Returns TRUE if there is a set bit, FALSE otherwise.
+	 */
+	bool find_prev(uint64_t& index) const
+	{
+		if (!_nr_bits) return false;
+		if (index >= _nr_bits) index = _nr_bits - 1;
+
+		uint64_t w = index / 64;
+		uint64_t bits = _words[w] & (~0ull >> (63 - index % 64));
+
+		if (!bits) {
+			if (w == 0) return false;
+			w--;
+
+			uint64_t s = w / 64;
+			uint64_t summary = _summary[s] & (~0ull >> (63 - w % 64));
+			while (!summary) {
+				if (s == 0) return false;
+				summary = _summary[--s];
+			}
+
+			w = s * 64 + 63 - __builtin_clzll(summary);
+			bits = _words[w];
+		}
+
+		index = w * 64 + 63 - __builtin_clzll(bits);
+		return true;
+	}
+
+private:
+	uint64_t *_words;
+	uint64_t *_summary;
+	uint64_t _nr_bits;
+	uint64_t _nr_words;
+	uint64_t _nr_summary_words;
+};
+
+/**
+ * A cache of free order-0 pages in front of the buddy lists.  Pages are pushed and popped at the
+ * hot end (most recently freed, so most likely still in the CPU cache), and drained back to the
+ * buddy lists from the cold end.
+ */
+struct PageCache
+{
+	unsigned int count;
+	PageDescriptor *pages[PCP_HIGH + 1];	// pages[0] is the coldest
+};
+
+/**
+ * A test-and-set spinlock.  Holders never sleep, and only hold it for a handful of list
+ * operations.  Every lock an allocation or a free can take is only ever held with interrupts
+ * disabled, so that an interrupt handler that allocates cannot spin forever on a lock held by
+ * the code it interrupted.
+ */
+class SpinLock
+{
+public:
+	SpinLock() : _locked(false) { }
+
+	void lock()
+	{
+		while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
+			while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) {
+				asm volatile("pause");
+			}
+		}
+	}
+
+	void unlock()
+	{
+		__atomic_clear(&_locked, __ATOMIC_RELEASE);
+	}
+
+private:
+	bool _locked;
+};
+
+/**
+ * Builds up a debug log line piece by piece.  Appending is O(1), and a line that fills up is
+ * flushed to the log and carried on in the next one, rather than being truncated.
+ */
+class LogLineBuilder
+{
+public:
+	LogLineBuilder(const char *prefix) : _prefix(prefix)
+	{
+		reset();
+	}
+
+	/** Appends formatted text to the line. */
+	template<typename... Args>
+	void appendf(const char *fmt, Args... args)
+	{
+		char token[48];
+		int length = snprintf(token, sizeof(token), fmt, args...);
+
+		if (_length + length >= (int)sizeof(_buffer)) {
+			flush();
+		}
+
+		memcpy(&_buffer[_length], token, length + 1);
+		_length += length;
+	}
+
+	/** Writes the line out to the log, and starts a new one. */
+	void flush()
+	{
+		mm_log.messagef(LogLevel::DEBUG, "%s", _buffer);
+		reset();
+	}
+
+private:
+	void reset()
+	{
+		_length = snprintf(_buffer, sizeof(_buffer), "%s", _prefix);
+	}
+
+	const char *_prefix;
+	char _buffer[160];
+	int _length;
+};
+
+/* The instance the allocator's kernel daemons work on, and the one buddy_allocator() returns. */
+static BuddyAllocatorAlgorithm *active_allocator;
+
+BuddyAllocatorAlgorithm *buddy_allocator()
+{
+	return active_allocator;
+}
+
+/* The shrinkers registered with RegisterPageShrinker, which every allocator starts out with. */
+static PageShrinker registered_shrinkers[MAX_SHRINKERS];
+static unsigned int nr_registered_shrinkers;
+
+PageShrinkerRegistration::PageShrinkerRegistration(PageShrinker shrinker)
+{
+	if (nr_registered_shrinkers < MAX_SHRINKERS) {
+		registered_shrinkers[nr_registered_shrinkers++] = shrinker;
+	}
+}
+
+/*
+ * The per-page tables, and the trace ring.  These are far too big for every variant of the
+ * allocator to carry a copy, and only the one picked with pgalloc.algorithm is ever initialised,
+ * so they all share them.
+ */
+static FreeBlockInfo free_info[MAX_PFNS];
+static uint8_t pageblock_mobilities[MAX_PFNS >> PAGEBLOCK_ORDER];
+static uint64_t free_bitmap_words[FREE_BITMAP_WORDS];
+static uint64_t free_bitmap_summary[FREE_BITMAP_SUMMARY_WORDS];
+static TraceRing trace_ring;
+
+/**
+ * A buddy page allocation algorithm, built for a given geometry and free list policy.
+ * Pages are always PAGE_SHIFT in size, as the kernel lays them out.
+ * @param max_order The largest order of block, which is no more than MAX_ORDER.
+ * @param policy Which free block of the right size an allocation takes.
+ */
+template<int max_order, FreeListPolicy policy>
+class BuddyAllocator : public BuddyAllocatorAlgorithm
+{
+	static_assert(max_order >= PAGEBLOCK_ORDER && max_order <= MAX_ORDER, "max_order must fit the shared tables");
+
+private:
+	/** Returns the number of pages in a block of the given order. */
+	static constexpr uint64_t pages_per_block(int order) { return 1ull << order; }
+
+	/** Returns the smallest order whose blocks hold the given number of pages. */
+	static constexpr int order_for(uint64_t nr_pages)
+	{
+		int order = 0;
+		while (pages_per_block(order) < nr_pages) order++;
+
+		return order;
+	}
+
+	/** Takes every order lock, lowest order first. */
+	void lock_all_orders() const
+	{
+		for (int order = 0; order <= max_order; order++) {
+			_order_locks[order].lock();
+		}
+	}
+
+	/** Releases every order lock. */
+	void unlock_all_orders() const
+	{
+		for (int order = max_order; order >= 0; order--) {
+			_order_locks[order].unlock();
+		}
+	}
+
+	/** Holds every order lock, with interrupts disabled, for the lifetime of the object. */
+	class AllOrdersLock
+	{
+	public:
+		AllOrdersLock(const BuddyAllocator& allocator) : _allocator(allocator) { _allocator.lock_all_orders(); }
+		~AllOrdersLock() { _allocator.unlock_all_orders(); }
+
+	private:
+		UniqueIRQLock _irq;	// taken before the order locks, and given back after them
+		const BuddyAllocator& _allocator;
+	};
+
+	/**
+	 * Returns the page-frame-number of the given page descriptor.  This is computed against the
+	 * descriptor array handed to init(), rather than going through the page allocator, so the
+	 * hot paths need nothing from the rest of the kernel.
+	 */
+	inline pfn_t pgd_to_pfn(const PageDescriptor *pgd) const { return (pfn_t)(pgd - _page_descriptors); }
+
+	/** Returns the page descriptor of the given page-frame-number. */
+	inline PageDescriptor *pfn_to_pgd(pfn_t pfn) const { return &_page_descriptors[pfn]; }
+
+	/** Returns the virtual address of the memory described by the given page descriptor. */
+	inline void *pgd_to_vpa(const PageDescriptor *pgd) const { return sys.mm().pgalloc().pgd_to_vpa(pgd); }
+
+	/** Returns the memory node the given page belongs to. */
+	inline unsigned int node_of(pfn_t pfn) const { return pfn >> _node_shift; }
+
+	/**
+	 * Returns the memory node of the CPU we are running on.  Only the boot CPU is brought up,
+	 * so this is always the first node.
+	 */
+	inline unsigned int local_node() const { return 0; }
+
+	/** Returns TRUE if allocations take the lowest-addressed free block that fits. */
+	static inline bool address_ordered() { return policy == FREE_LIST_ADDRESS_ORDERED || pgalloc_ordered; }
+
+	/** Returns the mobility type of the pageblock containing the given page. */
+	inline PageMobility pageblock_mobility(pfn_t pfn) const
+	{
+		return (PageMobility)pageblock_mobilities[pfn >> PAGEBLOCK_ORDER];
+	}
+
+	/** Returns TRUE if the given page descriptor is a valid block head in the given order. */
+	inline bool is_correct_alignment_for_order(const PageDescriptor *pgd, int order) const
+	{
+		return (pgd_to_pfn(pgd) & (pages_per_block(order) - 1)) == 0;
+	}
+
+	/**
+	 * Returns TRUE if the given page is the head of a free block of the given order.  The order
+	 * is written under the lock of whichever order the block is entering or leaving, so it is
+	 * read atomically; it can only equal the given order while the block is on that order's
+	 * list, which the caller holds the lock of.
+	 */
+	inline bool is_free_block(pfn_t pfn, int order) const
+	{
+		return __atomic_load_n(&free_info[pfn].order, __ATOMIC_RELAXED) == order;
+	}
+
+	/** Returns TRUE if the buddy of the given block is a free block of the same order. */
+	inline bool buddy_is_free(PageDescriptor *pgd, int order)
+	{
+		PageDescriptor *buddy = buddy_of(pgd, order);
+		return buddy && is_free_block(pgd_to_pfn(buddy), order);
+	}
+
+	/** Clears what mark_allocated() recorded, for a block that is coming back. */
+	inline void mark_free(PageDescriptor *pgd)
+	{
+		free_info[pgd_to_pfn(pgd)].alloc_order = NOT_FREE;
+		pgd->next_free = NULL;
+	}
+
+	/** Records the order of a block that is being handed out, and poisons its list link. */
+	inline void mark_allocated(PageDescriptor *pgd, int order)
+	{
+		free_info[pgd_to_pfn(pgd)].alloc_order = order;
+		pgd->next_free = ALLOCATED_POISON;
+	}
+
+	/**
+	 * Returns the slot pointing to a block on the free list of the given order, by following
+	 * the block's back-link.
+	 */
+	inline PageDescriptor **slot_of(const PageDescriptor *pgd, int order)
+	{
+		const FreeBlockInfo& info = free_info[pgd_to_pfn(pgd)];
+		return info.prev_free == NO_PFN ? &_free_areas[node_of(pgd_to_pfn(pgd))][info.mobility][order] : &pfn_to_pgd(info.prev_free)->next_free;
+	}
+
+	/**
+	 * Adds a free block to the free list of the given order, for the node and the mobility type
+	 * of the pageblock it lives in.  The block goes on the head of the list, unless the policy
+	 * is FIFO, when it goes on the tail.
+	 * @return Returns the slot pointing to the block.
+	 */
+	PageDescriptor **insert_block(PageDescriptor *pgd, int order)
+	{
+		pfn_t pfn = pgd_to_pfn(pgd);
+		PageMobility mobility = pageblock_mobility(pfn);
+
+		// A block bigger than a pageblock brings all the pageblocks it covers along with it.
+		if (order > PAGEBLOCK_ORDER) {
+			for (pfn_t pageblock = 1; pageblock < pages_per_block(order - PAGEBLOCK_ORDER); pageblock++) {
+				pageblock_mobilities[(pfn >> PAGEBLOCK_ORDER) + pageblock] = mobility;
+			}
+		}
+
+		unsigned int node = node_of(pfn);
+		PageDescriptor **slot = &_free_areas[node][mobility][order];
+
+		if (policy == FREE_LIST_FIFO && *slot) {
+			PageDescriptor *tail = _free_tails[node][mobility][order];
+
+			slot = &tail->next_free;
+			free_info[pfn].prev_free = pgd_to_pfn(tail);
+		} else {
+			free_info[pfn].prev_free = NO_PFN;
+		}
+
+		pgd->next_free = *slot;
+		if (pgd->next_free) {
+			free_info[pgd_to_pfn(pgd->next_free)].prev_free = pfn;
+		}
+
+		__atomic_store_n(&free_info[pfn].order, order, __ATOMIC_RELAXED);
+		free_info[pfn].mobility = mobility;
+		*slot = pgd;
+		_free_bitmaps[order].set(pfn >> order);
+		_nr_free_blocks[order]++;
+		__atomic_add_fetch(&_nr_free_pages, pages_per_block(order), __ATOMIC_RELAXED);
+
+		if (policy == FREE_LIST_FIFO) {
+			_free_tails[node][mobility][order] = pgd;
+		}
+
+		return slot;
+	}
+
+	/**
+	 * Unlinks a block from anywhere in the free list of the given order, in constant time.
+	 * @return Returns the block that was unlinked.
+	 */
+	PageDescriptor *remove_block(PageDescriptor *pgd, int order)
+	{
+		pfn_t pfn = pgd_to_pfn(pgd);
+		FreeBlockInfo& info = free_info[pfn];
+
+		if (policy == FREE_LIST_FIFO && !pgd->next_free) {
+			_free_tails[node_of(pfn)][info.mobility][order] = info.prev_free == NO_PFN ? NULL : pfn_to_pgd(info.prev_free);
+		}
+
+		*slot_of(pgd, order) = pgd->next_free;
+		if (pgd->next_free) {
+			free_info[pgd_to_pfn(pgd->next_free)].prev_free = info.prev_free;
+		}
+
+		pgd->next_free = NULL;
+		__atomic_store_n(&info.order, NOT_FREE, __ATOMIC_RELAXED);
+		_free_bitmaps[order].clear(pfn >> order);
+		_nr_free_blocks[order]--;
+		__atomic_sub_fetch(&_nr_free_pages, pages_per_block(order), __ATOMIC_RELAXED);
+
+		return pgd;
+	}
+
+	/**
+	 * Finds the free block containing the given page.
+	 * @param pfn The page-frame-number of the page.
+	 * @param order Receives the order of the free block.
+	 * @return Returns the head of the free block, or NULL if the page is not free.
+	 */
+	PageDescriptor *find_free_block(pfn_t pfn, int& order) const
+	{
+		for (order = 0; order <= max_order; order++) {
+			pfn_t head = pfn & ~(pages_per_block(order) - 1);
+			if (free_info[head].order == order) return pfn_to_pgd(head);
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Starts timing an allocator entry point, when tracing is enabled.
+	 * @return Returns the TSC to pass on to trace().
+	 */
+	inline uint64_t trace_begin() const
+	{
+		if (__builtin_expect(!pgalloc_debug, 1)) return 0;
+
+		return rdtsc();
+	}
+
+	/**
+	 * Records an event in the trace ring, when tracing is enabled.
+	 * @param type The type of event.
+	 * @param pgd The block involved, or NULL.
+	 * @param order The order of the block.
+	 * @param start_tsc The TSC from trace_begin(), for timed events, or zero.
+	 * @param caller The return address of the entry point the event happened under, or the
+	 * entry point of the daemon doing the work.
+	 */
+	inline void trace(TraceEventType type, const PageDescriptor *pgd, int order, uint64_t start_tsc, void *caller)
+	{
+		if (__builtin_expect(!pgalloc_debug, 1)) return;
+
+		uint64_t now = rdtsc();
+		TraceEvent& event = trace_ring.events[__atomic_fetch_add(&trace_ring.head, 1, __ATOMIC_RELAXED) % TRACE_RING_SIZE];
+
+		event.tsc = now;
+		event.caller = (uint64_t)caller;
+		event.pfn = pgd ? pgd_to_pfn(pgd) : NO_PFN;
+		event.cycles = start_tsc ? now - start_tsc : 0;
+		event.type = type;
+		event.order = order;
+	}
+
+	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
+	 * to the left or the right of PGD, in the given order.
+	 * @param pgd The page descriptor to find the buddy for.
+	 * @param order The order in which the page descriptor lives.
+	 * @return Returns the buddy of the given page descriptor, in the given order.
+	 */
+	PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
+	{
+		// Blocks in the top order have no buddy, and a misaligned PGD is not a block head.
+		if (order >= max_order || !is_correct_alignment_for_order(pgd, order)) return NULL;
+
+		pfn_t buddy_pfn = pgd_to_pfn(pgd) ^ pages_per_block(order);
+		if (buddy_pfn >= _nr_pfns) return NULL;
+
+		return pfn_to_pgd(buddy_pfn);
+	}
+
+	/**
+	 * Given a pointer to a block of free memory in the order "source_order", this function will
+	 * split the block in half, and insert it into the order below.
+	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
+	 * @param source_order The order in which the block of free memory exists.  Naturally,
+	 * the split will insert the two new blocks into the order below.
+	 * @param caller Who the split is being done for, for the trace.
+	 * @return Returns the left-hand-side of the new block.
+	 */
+	PageDescriptor *split_block(PageDescriptor **block_pointer, int source_order, void *caller)
+	{
+		PageDescriptor *left = remove_block(*block_pointer, source_order);
+		int target_order = source_order - 1;
+
+		trace(TRACE_SPLIT, left, source_order, 0, caller);
+
+		// Insert the right half first, so the left half ends up at the head of the list.
+		insert_block(left + pages_per_block(target_order), target_order);
+		insert_block(left, target_order);
+
+		return left;
+	}
+
+	/**
+	 * Takes a block in the given source order, and merges it (and its buddy) into the next order.
+	 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
+	 * @param source_order The order in which the pair of blocks live.
+	 * @param caller Who the merge is being done for, for the trace.
+	 * @return Returns the new slot that points to the merged block.
+	 */
+	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order, void *caller)
+	{
+		PageDescriptor *pgd = remove_block(*block_pointer, source_order);
+		PageDescriptor *buddy = remove_block(buddy_of(pgd, source_order), source_order);
+
+		trace(TRACE_MERGE, pgd, source_order, 0, caller);
+
+		return insert_block(pgd < buddy ? pgd : buddy, source_order + 1);
+	}
+
+	/**
+	 * Frees a block into the given order, coalescing it with its buddy for as long as the
+	 * buddy is free too.  The caller holds every order lock.
+	 */
+	void free_block(PageDescriptor *pgd, int order, void *caller)
+	{
+		mark_free(pgd);
+
+		PageDescriptor **slot = insert_block(pgd, order);
+
+		while (buddy_is_free(pgd, order)) {
+			slot = merge_block(slot, order, caller);
+			pgd = *slot;
+			order++;
+		}
+	}
+
+	/**
+	 * Frees a run of pages by carving it into the largest naturally-aligned blocks that fit.
+	 * @param start The first page of the run.
+	 * @param count The number of pages in the run.
+	 */
+	void free_range(PageDescriptor *start, uint64_t count, void *caller)
+	{
+		pfn_t pfn = pgd_to_pfn(start);
+		pfn_t end = pfn + count;
+
+		while (pfn < end) {
+			int order = 0;
+			while (order < max_order && !(pfn & pages_per_block(order)) && pfn + pages_per_block(order + 1) <= end) {
+				order++;
+			}
+
+			free_block(pfn_to_pgd(pfn), order, caller);
+			pfn += pages_per_block(order);
+		}
+	}
+
+	/**
+	 * Takes a block of the given order from the free lists of a mobility type on one node,
+	 * holding no more than one order lock at a time.  The source block is unlinked under its own order's lock,
+	 * and the unused halves are handed back one order at a time on the way down, so the block
+	 * is never visible half-split.
+	 * @return Returns the block, or NULL if the mobility type has no block big enough.
+	 */
+	PageDescriptor *take_block(int order, PageMobility mobility, unsigned int node, void *caller)
+	{
+		UniqueIRQLock l;
+
+		for (int source_order = order; source_order <= max_order; source_order++) {
+			_order_locks[source_order].lock();
+
+			PageDescriptor *block = _free_areas[node][mobility][source_order];
+			if (block) {
+				remove_block(block, source_order);
+			}
+
+			_order_locks[source_order].unlock();
+
+			if (!block) continue;
+
+			// Give back the right-hand halves, from the top down.
+			while (source_order > order) {
+				trace(TRACE_SPLIT, block, source_order, 0, caller);
+				source_order--;
+
+				_order_locks[source_order].lock();
+				insert_block(block + pages_per_block(source_order), source_order);
+				_order_locks[source_order].unlock();
+			}
+
+			mark_allocated(block, order);
+			return block;
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Frees a block, coalescing it from the bottom up while holding no more than one order lock
+	 * at a time.  The block stays off the free lists until it finds an order where its buddy is
+	 * not free, so nobody else can see it while it is being merged.
+	 */
+	void release_block(PageDescriptor *pgd, int order, void *caller)
+	{
+		UniqueIRQLock l;
+
+		mark_free(pgd);
+
+		while (true) {
+			_order_locks[order].lock();
+
+			if (buddy_is_free(pgd, order)) {
+				PageDescriptor *buddy = remove_block(buddy_of(pgd, order), order);
+				_order_locks[order].unlock();
+
+				trace(TRACE_MERGE, pgd, order, 0, caller);
+
+				if (buddy < pgd) pgd = buddy;
+				order++;
+				continue;
+			}
+
+			insert_block(pgd, order);
+			_order_locks[order].unlock();
+			return;
+		}
+	}
+
+	/**
+	 * Allocates a block from the buddy lists, taking all of the order locks only when the
+	 * mobility type has run dry on the preferred node, and the block has to be stolen or come
+	 * from another node.
+	 * @return Returns the block, or NULL if no block of that order (or above) is free.
+	 */
+	PageDescriptor *allocate_any_block(int order, PageMobility mobility, unsigned int node, void *caller)
+	{
+		// The lowest block could be in any order, so address-ordered allocation has to look at
+		// all of them at once.
+		if (!address_ordered()) {
+			PageDescriptor *block = take_block(order, mobility, node, caller);
+			if (block) return block;
+		}
+
+		// Stealing moves blocks between the lists of every order.
+		AllOrdersLock l(*this);
+		return allocate_block(order, mobility, node, caller);
+	}
+
+	/**
+	 * Moves the pageblocks under a free block over to the given mobility type, along with any
+	 * other free blocks they contain.
+	 * @param block The free block.
+	 * @param order The order of the free block.
+	 * @param mobility The mobility type to claim the pageblocks for.
+	 */
+	void claim_pageblocks(PageDescriptor *block, int order, PageMobility mobility)
+	{
+		pfn_t start = pgd_to_pfn(block) & ~(pages_per_block(PAGEBLOCK_ORDER) - 1);
+		pfn_t end = start + pages_per_block(order > PAGEBLOCK_ORDER ? order : PAGEBLOCK_ORDER);
+		if (end > _nr_pfns) end = _nr_pfns;
+
+		for (pfn_t pfn = start; pfn < end; pfn += pages_per_block(PAGEBLOCK_ORDER)) {
+			pageblock_mobilities[pfn >> PAGEBLOCK_ORDER] = mobility;
+		}
+
+		pfn_t pfn = start;
+		while (pfn < end) {
+			int free_order = free_info[pfn].order;
+			if (free_order == NOT_FREE) {
+				pfn++;
+				continue;
+			}
+
+			// Re-inserting puts the block on the lists of its pageblock's new type.
+			PageDescriptor *pgd = remove_block(pfn_to_pgd(pfn), free_order);
+			insert_block(pgd, free_order);
+
+			pfn += pages_per_block(free_order);
+		}
+	}
+
+	/**
+	 * Takes a free block from another mobility type, when the given type has none left.  The
+	 * largest block available is taken, so that as few pageblocks as possible get mixed.
+	 * @param order The smallest order that will do.
+	 * @param mobility The mobility type that has run dry.
+	 * @param node The node to steal on.
+	 * @param source_order Receives the order of the block.
+	 * @return Returns the block (still on a free list), or NULL if the node has no free memory left.
+	 */
+	PageDescriptor *steal_block(int order, PageMobility mobility, unsigned int node, int& source_order)
+	{
+		for (source_order = max_order; source_order >= order; source_order--) {
+			for (PageMobility fallback : mobility_fallbacks[mobility]) {
+				PageDescriptor *block = _free_areas[node][fallback][source_order];
+				if (!block) continue;
+
+				// A steal of at least half a pageblock takes the whole pageblock, so the next
+				// allocations of this type are grouped with it rather than breaking up yet
+				// another pageblock.
+				if (source_order >= PAGEBLOCK_ORDER - 1) {
+					claim_pageblocks(block, source_order, mobility);
+				}
+
+				return block;
+			}
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Sets a node to fall back on the nearest nodes first, which is the default.
+	 * @param node The node.
+	 * @param nr_nodes The number of nodes.
+	 */
+	void set_default_fallbacks(unsigned int node, unsigned int nr_nodes)
+	{
+		unsigned int i = 0;
+		_node_fallbacks[node][i++] = node;
+
+		for (unsigned int distance = 1; i < nr_nodes; distance++) {
+			if (node >= distance) _node_fallbacks[node][i++] = node - distance;
+			if (node + distance < nr_nodes) _node_fallbacks[node][i++] = node + distance;
+		}
+	}
+
+	/**
+	 * Sets up the free block entries of memory about to be hot-added past the end of the range
+	 * being managed.  Nothing looks at the entries past _nr_pfns, so this runs without the order
+	 * locks, and interrupts on; the caller holds _grow_lock, so that nobody else publishes the
+	 * entries before they are ready.  Pages past the last node there is room for are left out.
+	 * @param end The page-frame-number just past the new memory.
+	 * @return Returns the new end of the range, to hand to grow_to().
+	 */
+	pfn_t prepare_growth(pfn_t end)
+	{
+		pfn_t limit = (pfn_t)MAX_NODES << _node_shift;
+		if (limit > MAX_PFNS) limit = MAX_PFNS;
+		if (end > limit) end = limit;
+
+		for (pfn_t pfn = _nr_pfns; pfn < end; pfn++) {
+			free_info[pfn].order = NOT_FREE;
+			free_info[pfn].alloc_order = NOT_FREE;
+		}
+
+		return end;
+	}
+
+	/**
+	 * Extends the range of pages being managed to memory set up with prepare_growth().  The
+	 * metadata is all sized for MAX_PFNS up front, so nothing has to move: the bitmaps and nodes
+	 * are sized to the new end, and then it is published.  The caller holds every order lock.
+	 * @param end The new end of the range, from prepare_growth().
+	 */
+	void grow_to(pfn_t end)
+	{
+		if (end <= _nr_pfns) return;
+
+		for (int order = 0; order <= max_order; order++) {
+			_free_bitmaps[order].grow((end + pages_per_block(order) - 1) >> order);
+		}
+
+		// Memory beyond the last node makes new nodes.  The existing nodes fall back on them
+		// last, so that any fallback orders that have been set still come first.
+		unsigned int nr_nodes = ((end - 1) >> _node_shift) + 1;
+		for (unsigned int node = _nr_nodes; node < nr_nodes; node++) {
+			for (unsigned int other = 0; other < _nr_nodes; other++) {
+				_node_fallbacks[other][node] = node;
+			}
+
+			set_default_fallbacks(node, nr_nodes);
+		}
+
+		// Paths that run without the locks check requests against these, so they go last.
+		__atomic_store_n(&_nr_nodes, nr_nodes, __ATOMIC_RELEASE);
+		__atomic_store_n(&_nr_pfns, end, __ATOMIC_RELEASE);
+
+		set_watermarks();
+	}
+
+	/**
+	 * Finds the lowest-addressed free block of at least the given order, on the preferred node
+	 * or failing that the other nodes in its fallback order.  Blocks in pageblocks that are being
+	 * compacted are passed over.
+	 * @param order The smallest order that will do.
+	 * @param node The preferred node.
+	 * @param source_order Receives the order of the block.
+	 * @return Returns the block (still on a free list), or NULL if there is no free memory left.
+	 */
+	PageDescriptor *find_lowest_block(int order, unsigned int node, int& source_order) const
+	{
+		for (unsigned int i = 0; i < _nr_nodes; i++) {
+			pfn_t node_start = (pfn_t)_node_fallbacks[node][i] << _node_shift;
+			pfn_t node_end = node_start + pages_per_block(_node_shift);
+
+			PageDescriptor *lowest = NULL;
+			for (int candidate_order = order; candidate_order <= max_order; candidate_order++) {
+				pfn_t end = lowest ? pgd_to_pfn(lowest) : node_end;
+
+				uint64_t index = node_start >> candidate_order;
+				while (_free_bitmaps[candidate_order].find_next(index) && (index << candidate_order) < end) {
+					pfn_t pfn = index << candidate_order;
+					if (free_info[pfn].mobility != MOBILITY_ISOLATE) {
+						lowest = pfn_to_pgd(pfn);
+						source_order = candidate_order;
+						break;
+					}
+
+					index++;
+				}
+			}
+
+			if (lowest) return lowest;
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Finds the smallest free block of at least the given order for a mobility type, falling
+	 * back to stealing from the other types, and then to the other nodes in the preferred
+	 * node's fallback order.
+	 * @param order The smallest order that will do.
+	 * @param mobility The mobility type of the allocation.
+	 * @param node The preferred node.
+	 * @param source_order Receives the order of the block.
+	 * @return Returns the block (still on a free list), or NULL if there is no free memory left.
+	 */
+	PageDescriptor *find_block(int order, PageMobility mobility, unsigned int node, int& source_order)
+	{
+		if (address_ordered()) return find_lowest_block(order, node, source_order);
+
+		for (unsigned int i = 0; i < _nr_nodes; i++) {
+			PageDescriptor **free_area = _free_areas[_node_fallbacks[node][i]][mobility];
+
+			for (source_order = order; source_order <= max_order; source_order++) {
+				if (free_area[source_order]) return free_area[source_order];
+			}
+
+			PageDescriptor *block = steal_block(order, mobility, _node_fallbacks[node][i], source_order);
+			if (block) return block;
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Counts the free pages in an aligned region.
+	 * @param start The first page of the region.
+	 * @param order The order of the region.
+	 */
+	uint64_t count_free_pages(pfn_t start, int order) const
+	{
+		// A free block overlapping the start of an aligned region covers all of it.
+		int free_order;
+		if (find_free_block(start, free_order)) return pages_per_block(order);
+
+		uint64_t nr_free = 0;
+
+		pfn_t pfn = start;
+		while (pfn < start + pages_per_block(order)) {
+			free_order = free_info[pfn].order;
+			if (free_order == NOT_FREE) {
+				pfn++;
+				continue;
+			}
+
+			nr_free += pages_per_block(free_order);
+			pfn += pages_per_block(free_order);
+		}
+
+		return nr_free;
+	}
+
+	/** Returns TRUE if an aligned region of the given order is made up only of movable pageblocks. */
+	bool region_is_movable(pfn_t start, int order) const
+	{
+		for (pfn_t pfn = start; pfn < start + pages_per_block(order); pfn += pages_per_block(PAGEBLOCK_ORDER)) {
+			if (pageblock_mobility(pfn) != MOBILITY_MOVABLE) return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Finds the aligned region of the given order, made up only of movable pageblocks, that has
+	 * the fewest pages left to migrate out of it.  This walks all of memory, so it runs without
+	 * the locks, and what it finds is only a candidate to be checked again under them.
+	 * @return Returns the head of the region, or NULL if there is no candidate.
+	 */
+	PageDescriptor *find_sparsest_region(int order) const
+	{
+		pfn_t best = NO_PFN;
+		uint64_t best_nr_free = 0;
+
+		pfn_t nr_pfns = __atomic_load_n(&_nr_pfns, __ATOMIC_ACQUIRE);
+		for (pfn_t start = 0; start + pages_per_block(order) <= nr_pfns; start += pages_per_block(order)) {
+			if (!region_is_movable(start, order)) continue;
+
+			uint64_t nr_free = count_free_pages(start, order);
+			if (nr_free > best_nr_free) {
+				best = start;
+				best_nr_free = nr_free;
+			}
+		}
+
+		return best == NO_PFN ? NULL : pfn_to_pgd(best);
+	}
+
+	/**
+	 * Finds the next allocated block in a region being compacted, and a free block elsewhere to
+	 * migrate it to.  Free blocks are stepped over.  The allocated block is isolated, by
+	 * recording MIGRATING in place of its order, so that a free of it while it is being moved is
+	 * held back.  The caller holds every order lock.
+	 * @param pfn The page to start from, which is moved on past any free blocks.
+	 * @param end The end of the region.
+	 * @param order The order of the region.
+	 * @param block_order Receives the order of the allocated block.
+	 * @return Returns the block to migrate to, or NULL if the region is free from pfn onwards, or
+	 * holds something that cannot be migrated.
+	 */
+	PageDescriptor *next_migration(pfn_t& pfn, pfn_t end, int order, int& block_order, void *caller)
+	{
+		while (pfn < end) {
+			PageDescriptor *block = find_free_block(pfn, block_order);
+			if (!block) break;
+
+			pfn = pgd_to_pfn(block) + pages_per_block(block_order);
+		}
+
+		if (pfn >= end) return NULL;
+
+		// Only a whole block with a recorded order can be moved.  Pages in the per-CPU cache,
+		// runs from allocate_contiguous() and memory that was never ours all pin the region.
+		block_order = free_info[pfn].alloc_order;
+		if (pfn_to_pgd(pfn)->next_free != ALLOCATED_POISON || block_order == NOT_FREE || block_order >= order) return NULL;
+
+		PageDescriptor *to = allocate_block(block_order, MOBILITY_MOVABLE, node_of(pfn), caller);
+		if (to) {
+			free_info[pfn].alloc_order = MIGRATING;
+			_migration_freed = false;
+		}
+
+		return to;
+	}
+
+	/**
+	 * Finishes migrating a block isolated by next_migration().  The old block is freed if it
+	 * was moved, or if its owner freed it in the meantime; otherwise it gets its order back.
+	 * The new block is kept only if the block was moved.  The caller holds every order lock.
+	 * @return Returns TRUE if the old block is free, FALSE if it is still allocated.
+	 */
+	bool commit_migration(PageDescriptor *from, PageDescriptor *to, int block_order, bool migrated, void *caller)
+	{
+		if (!migrated) {
+			free_block(to, block_order, caller);
+		}
+
+		FreeBlockInfo& info = free_info[pgd_to_pfn(from)];
+		if (info.alloc_order != MIGRATING) return true;
+
+		if (!migrated && !_migration_freed) {
+			info.alloc_order = block_order;
+			return false;
+		}
+
+		free_block(from, block_order, caller);
+		return true;
+	}
+
+	/**
+	 * Tries to assemble a free block of the given order, by migrating the allocated blocks out
+	 * of the sparsest region of movable pageblocks.  The region is found without the locks,
+	 * and they are only held to check and isolate it, and to isolate each block and commit its
+	 * migration: the migrator copies and remaps each block with none held.  Only one compaction
+	 * runs at a time.
+	 * @param order The order of the block to assemble.
+	 * @param max_pages The most pages to migrate.  If the sparsest region needs more than this,
+	 * it is left alone.
+	 * @param caller Who the compaction is being done for, for the trace.
+	 * @return Returns TRUE if the region was emptied.
+	 */
+	bool compact(int order, uint64_t max_pages, void *caller)
+	{
+		if (!_migrator) return false;
+		if (__atomic_exchange_n(&_compacting, true, __ATOMIC_ACQUIRE)) return false;
+
+		PageDescriptor *region = find_sparsest_region(order);
+		{
+			AllOrdersLock l(*this);
+
+			// Memory may have moved on since the scan, so the region is checked again now that
+			// nothing else can change it.
+			if (region && (!region_is_movable(pgd_to_pfn(region), order) ||
+				pages_per_block(order) - count_free_pages(pgd_to_pfn(region), order) > max_pages)) {
+				region = NULL;
+			}
+
+			// Isolate the region, so that nothing is allocated from it while the locks are
+			// dropped, and none of the blocks migrated out of it land back in it.
+			if (region) {
+				claim_pageblocks(region, order, MOBILITY_ISOLATE);
+			}
+		}
+
+		if (!region) {
+			__atomic_store_n(&_compacting, false, __ATOMIC_RELEASE);
+			return false;
+		}
+
+		pfn_t start = pgd_to_pfn(region);
+		pfn_t end = start + pages_per_block(order);
+		uint64_t nr_migrated = 0;
+
+		pfn_t pfn = start;
+		while (true) {
+			PageDescriptor *to;
+			int block_order;
+			{
+				AllOrdersLock l(*this);
+
+				to = next_migration(pfn, end, order, block_order, caller);
+			}
+
+			if (!to) break;
+
+			PageDescriptor *from = pfn_to_pgd(pfn);
+			bool migrated = _migrator(from, to, block_order);
+
+			bool freed;
+			{
+				AllOrdersLock l(*this);
+
+				freed = commit_migration(from, to, block_order, migrated, caller);
+			}
+
+			if (!freed) break;
+
+			if (migrated) nr_migrated += pages_per_block(block_order);
+			pfn += pages_per_block(block_order);
+		}
+
+		{
+			AllOrdersLock l(*this);
+
+			// Whether or not it worked, hand the region back, coalesced as far as it got.
+			claim_pageblocks(region, order, MOBILITY_MOVABLE);
+		}
+
+		__atomic_store_n(&_compacting, false, __ATOMIC_RELEASE);
+
+		mm_log.messagef(LogLevel::INFO, "buddy: compaction migrated %lu pages, %s order %d at %lx",
+			nr_migrated, pfn >= end ? "recovered" : "could not recover", order, start);
+
+		return pfn >= end;
+	}
+
+	/**
+	 * Runs compaction requests in the background.  Failed high-order allocations leave their
+	 * order in _compaction_request and wake the daemon, which works on it at DAEMON priority and
+	 * sleeps while there is nothing to do.
+	 */
+	void compaction_daemon()
+	{
+		while (true) {
+			int order;
+
+			{
+				// Checking for work and going to sleep happen together, so no wake-up is lost.
+				UniqueIRQLock l;
+
+				order = _compaction_request;
+				if (!order) {
+					_compaction_daemon->sleep();
+					continue;
+				}
+
+				_compaction_request = 0;
+			}
+
+			compact(order, pages_per_block(order), (void *)&compaction_daemon_entry);
+		}
+	}
+
+	static void compaction_daemon_entry()
+	{
+		static_cast<BuddyAllocator *>(active_allocator)->compaction_daemon();
+	}
+
+	/**
+	 * Wakes one of the allocator's kernel daemons, starting it at DAEMON priority the first time.
+	 * Daemons are only started once they are needed, by which point the kernel process is up.
+	 * The caller disables interrupts around publishing the work and the wake-up.
+	 * @param daemon The daemon's thread, DAEMON_STARTING while it is being created, or NULL if
+	 * it has not been started.
+	 * @param entry The daemon's entry point.
+	 */
+	static void wake_daemon(Thread *& daemon, void (*entry)())
+	{
+		// Creating the thread allocates, which can come straight back here.  The work has been
+		// published already, so the daemon will find it once it is up.
+		if (daemon == DAEMON_STARTING) return;
+
+		if (daemon) {
+			daemon->wake_up();
+			return;
+		}
+
+		daemon = DAEMON_STARTING;
+
+		Thread *thread = &sys.kernel_process().create_thread(ThreadPrivilege::Kernel, (Thread::thread_proc_t)entry);
+		thread->priority(SchedulingEntityPriority::DAEMON);
+
+		daemon = thread;
+		thread->start();
+	}
+
+	/**
+	 * Zeroes pages with non-temporal stores, so that zeroing in the background does not evict
+	 * anything useful from the cache.
+	 */
+	static void zero_pages_nt(void *base, uint64_t nr_pages)
+	{
+		uint64_t *word = (uint64_t *)base;
+		uint64_t *end = word + ((nr_pages << PAGE_SHIFT) / sizeof(uint64_t));
+
+		for (; word < end; word += 4) {
+			asm volatile(
+				"movnti %1, 0(%0)\n"
+				"movnti %1, 8(%0)\n"
+				"movnti %1, 16(%0)\n"
+				"movnti %1, 24(%0)\n"
+				:: "r"(word), "r"(0ul) : "memory");
+		}
+
+		asm volatile("sfence" ::: "memory");
+	}
+
+	/**
+	 * Tops up the first zeroed pool that is below its target by one block.
+	 * @return Returns TRUE if a block was added, FALSE if every pool is full (or memory is out).
+	 */
+	bool zero_pool_refill_one()
+	{
+		int order;
+		PageDescriptor *block = NULL;
+
+		{
+			UniqueIRQLock l;
+
+			for (order = 0; order <= ZERO_POOL_MAX_ORDER; order++) {
+				if (_nr_zeroed[order] < (ZERO_POOL_PAGES >> order)) break;
+			}
+
+			if (order > ZERO_POOL_MAX_ORDER) return false;
+
+			block = allocate_any_block(order, MOBILITY_MOVABLE, local_node(), (void *)&zeroing_daemon_entry);
+			if (!block) return false;
+		}
+
+		// The block is off the free lists, so it can be zeroed without holding anything.
+		zero_pages_nt(pgd_to_vpa(block), pages_per_block(order));
+
+		UniqueIRQLock l;
+
+		block->next_free = _zeroed[order];
+		_zeroed[order] = block;
+		_nr_zeroed[order]++;
+
+		return true;
+	}
+
+	/**
+	 * Keeps the zeroed pools topped up at DAEMON priority, so it only runs when the CPU would
+	 * otherwise be idle.  Taking a zeroed block sets _zero_pool_requested and wakes the daemon,
+	 * which refills every pool and sleeps again.
+	 */
+	void zeroing_daemon()
+	{
+		while (true) {
+			{
+				UniqueIRQLock l;
+
+				if (!_zero_pool_requested) {
+					_zeroing_daemon->sleep();
+					continue;
+				}
+
+				_zero_pool_requested = false;
+			}
+
+			fill_zero_pools();
+		}
+	}
+
+	static void zeroing_daemon_entry()
+	{
+		static_cast<BuddyAllocator *>(active_allocator)->zeroing_daemon();
+	}
+
+	/**
+	 * Returns every block in the zeroed pools to the buddy lists.
+	 * @return Returns TRUE if anything was returned.
+	 */
+	bool zero_pool_drain(void *caller)
+	{
+		AllOrdersLock l(*this);
+
+		bool drained = false;
+		for (int order = 0; order <= ZERO_POOL_MAX_ORDER; order++) {
+			while (_zeroed[order]) {
+				PageDescriptor *block = _zeroed[order];
+				_zeroed[order] = block->next_free;
+				_nr_zeroed[order]--;
+
+				free_block(block, order, caller);
+				drained = true;
+			}
+		}
+
+		return drained;
+	}
+
+	/**
+	 * Tops the huge page pool up to the size asked for with pgalloc.hugepages.  This runs as
+	 * memory is handed to the allocator at boot, so the pool is filled before anything has had
+	 * the chance to fragment memory.  The caller holds every order lock.
+	 */
+	void huge_pool_fill(void *caller)
+	{
+		_huge_pool_lock.lock();
+
+		while (_nr_huge_pages < pgalloc_hugepages) {
+			// Pool pages are pinned for good, so they come out of unmovable pageblocks.
+			PageDescriptor *block = allocate_block(HUGE_PAGE_ORDER, MOBILITY_UNMOVABLE, local_node(), caller);
+			if (!block) break;
+
+			free_info[pgd_to_pfn(block)].alloc_order = HUGE_PAGE;
+			block->next_free = _huge_pool;
+			_huge_pool = block;
+			_nr_huge_pages++;
+			_nr_free_huge_pages++;
+		}
+
+		_huge_pool_lock.unlock();
+	}
+
+	/**
+	 * Takes any free huge pages overlapping a range out of the pool, handing back the parts
+	 * that lie outside the range.  The caller holds every order lock.
+	 */
+	void huge_pool_remove_range(pfn_t start, pfn_t end, void *caller)
+	{
+		_huge_pool_lock.lock();
+
+		PageDescriptor **slot = &_huge_pool;
+		while (*slot) {
+			PageDescriptor *block = *slot;
+			pfn_t block_start = pgd_to_pfn(block);
+			pfn_t block_end = block_start + pages_per_block(HUGE_PAGE_ORDER);
+
+			if (block_end <= start || block_start >= end) {
+				slot = &block->next_free;
+				continue;
+			}
+
+			*slot = block->next_free;
+			mark_free(block);
+			_nr_huge_pages--;
+			_nr_free_huge_pages--;
+
+			if (block_start < start) {
+				free_range(block, start - block_start, caller);
+			}
+
+			if (block_end > end) {
+				free_range(pfn_to_pgd(end), block_end - end, caller);
+			}
+		}
+
+		_huge_pool_lock.unlock();
+	}
+
+	/**
+	 * Returns the pages held in the per-CPU cache and the zeroed pools to the buddy lists, for
+	 * when something needs to see all of free memory.
+	 * @return Returns TRUE if anything was returned.
+	 */
+	bool drain_caches(void *caller)
+	{
+		bool drained = _pcp.count > 0;
+		pcp_drain(_pcp.count, caller);
+
+		return zero_pool_drain(caller) || drained;
+	}
+
+	/**
+	 * Asks the registered shrinkers for memory until free memory is back up to the given
+	 * target, or none of them has anything left to give.  Only one thread reclaims at a time,
+	 * and a shrinker that allocates does not recurse back into reclaim.
+	 * @return Returns the number of pages reclaimed.
+	 */
+	uint64_t reclaim(uint64_t target)
+	{
+		if (__atomic_exchange_n(&_reclaiming, true, __ATOMIC_ACQUIRE)) return 0;
+
+		uint64_t nr_reclaimed = 0;
+		bool progress = true;
+
+		while (progress) {
+			progress = false;
+
+			for (unsigned int i = 0; i < _nr_shrinkers; i++) {
+				uint64_t nr_free = nr_free_pages();
+				if (nr_free >= target) break;
+
+				uint64_t nr_freed = _shrinkers[i](target - nr_free);
+				nr_reclaimed += nr_freed;
+				progress |= nr_freed > 0;
+			}
+		}
+
+		__atomic_store_n(&_reclaiming, false, __ATOMIC_RELEASE);
+		return nr_reclaimed;
+	}
+
+	/**
+	 * Reclaims memory in the background.  Allocations that take free memory below the low
+	 * watermark set _reclaim_requested and wake the daemon, which works back up to the high
+	 * watermark.
+	 */
+	void reclaim_daemon()
+	{
+		while (true) {
+			{
+				UniqueIRQLock l;
+
+				if (!_reclaim_requested) {
+					_reclaim_daemon->sleep();
+					continue;
+				}
+
+				_reclaim_requested = false;
+			}
+
+			uint64_t nr_reclaimed = reclaim(_watermark_high);
+			mm_log.messagef(LogLevel::DEBUG, "buddy: reclaimed %lu pages, %lu free", nr_reclaimed, nr_free_pages());
+		}
+	}
+
+	static void reclaim_daemon_entry()
+	{
+		static_cast<BuddyAllocator *>(active_allocator)->reclaim_daemon();
+	}
+
+	/** Sizes the free memory watermarks to the number of pages being managed. */
+	void set_watermarks()
+	{
+		_watermark_min = _nr_pfns / WATERMARK_MIN_RATIO;
+		_watermark_low = _watermark_min + _watermark_min / 4;
+		_watermark_high = _watermark_min + _watermark_min / 2;
+	}
+
+	/**
+	 * Checks free memory against the watermarks after an allocation.  Below low, the reclaim
+	 * daemon is woken; below min, the allocating thread reclaims up to low itself before
+	 * carrying on.  Once direct reclaim has come up empty, allocations stop trying it until
+	 * free memory has been back over the low watermark, rather than every one of them asking
+	 * the shrinkers again for nothing.  This must not be called with interrupts disabled.
+	 */
+	void check_watermarks()
+	{
+		uint64_t nr_free = nr_free_pages();
+		if (nr_free >= _watermark_low) {
+			if (__builtin_expect(_direct_reclaim_stalled, 0)) _direct_reclaim_stalled = false;
+			return;
+		}
+
+		if (!_nr_shrinkers) return;
+
+		if (nr_free < _watermark_min) {
+			if (!_direct_reclaim_stalled && !reclaim(_watermark_low)) {
+				_direct_reclaim_stalled = true;
+			}
+
+			return;
+		}
+
+		UniqueIRQLock l;
+
+		_reclaim_requested = true;
+		wake_daemon(_reclaim_daemon, &reclaim_daemon_entry);
+	}
+
+	/** Writes a string out of the debugcon port. */
+	static void debugcon_write(const char *str)
+	{
+		for (; *str; str++) {
+			asm volatile("outb %0, %1" :: "a"(*str), "Nd"((uint16_t)DEBUGCON_PORT));
+		}
+	}
+
+	/**
+	 * Allocates a block of the given order straight from the buddy lists.  The caller holds
+	 * every order lock.
+	 * @return Returns the block, or NULL if no block of that order (or above) is free.
+	 */
+	PageDescriptor *allocate_block(int order, PageMobility mobility, unsigned int node, void *caller)
+	{
+		int source_order;
+		PageDescriptor *block = find_block(order, mobility, node, source_order);
+		if (!block) return NULL;
+
+		// Split it down until it is the requested size.
+		while (source_order > order) {
+			block = split_block(slot_of(block, source_order), source_order, caller);
+			source_order--;
+		}
+
+		remove_block(block, order);
+		mark_allocated(block, order);
+
+		return block;
+	}
+
+	/**
+	 * Allocates the block of the given order nearest to a page, straight from the buddy lists.
+	 * A larger free block may be nearer than any free block of the right size, so every order
+	 * from the requested one up is searched, and the winner is split down towards the page.  The
+	 * caller holds every order lock.
+	 * @param pfn The page-frame-number to allocate near.
+	 * @param order The order of the block.
+	 * @param mobility The mobility type of the allocation.
+	 * @return Returns the block, or NULL if no block of that order (or above) is free.
+	 */
+	PageDescriptor *allocate_block_near(pfn_t pfn, int order, PageMobility mobility, void *caller)
+	{
+		pfn_t target = pfn & ~(pages_per_block(order) - 1);
+
+		PageDescriptor *block = NULL;
+		int source_order = 0;
+		uint64_t best_distance = ~0ull;
+
+		for (int candidate_order = order; candidate_order <= max_order && best_distance; candidate_order++) {
+			uint64_t before = pfn >> candidate_order;
+			uint64_t after = before + 1;
+
+			bool found[] = { _free_bitmaps[candidate_order].find_prev(before), _free_bitmaps[candidate_order].find_next(after) };
+
+			// Blocks in pageblocks being compacted are passed over.
+			while (found[0] && free_info[before << candidate_order].mobility == MOBILITY_ISOLATE) {
+				found[0] = before > 0 && _free_bitmaps[candidate_order].find_prev(--before);
+			}
+
+			while (found[1] && free_info[after << candidate_order].mobility == MOBILITY_ISOLATE) {
+				found[1] = _free_bitmaps[candidate_order].find_next(++after);
+			}
+
+			uint64_t indices[] = { before, after };
+
+			for (int i = 0; i < 2; i++) {
+				if (!found[i]) continue;
+
+				// The nearest block of the requested order that this one can be split into.
+				pfn_t start = indices[i] << candidate_order;
+				pfn_t nearest = target < start ? start : target;
+				if (nearest > start + pages_per_block(candidate_order) - pages_per_block(order)) {
+					nearest = start + pages_per_block(candidate_order) - pages_per_block(order);
+				}
+
+				uint64_t distance = nearest < target ? target - nearest : nearest - target;
+				if (distance < best_distance) {
+					block = pfn_to_pgd(start);
+					source_order = candidate_order;
+					best_distance = distance;
+				}
+			}
+		}
+
+		if (!block) return NULL;
+
+		// The hint wins over grouping by mobility, but a block of at least half a pageblock
+		// still brings its pageblocks over, as it would if it had been stolen.
+		if (source_order >= PAGEBLOCK_ORDER - 1 && free_info[pgd_to_pfn(block)].mobility != mobility) {
+			claim_pageblocks(block, source_order, mobility);
+		}
+
+		while (source_order > order) {
+			PageDescriptor *left = split_block(slot_of(block, source_order), source_order, caller);
+			source_order--;
+
+			block = target >= pgd_to_pfn(left) + pages_per_block(source_order) ? left + pages_per_block(source_order) : left;
+		}
+
+		remove_block(block, order);
+		mark_allocated(block, order);
+
+		return block;
+	}
+
+	/**
+	 * Allocates a batch of blocks of the same order straight from the buddy lists, under one
+	 * acquisition of the locks.  A larger block is split once and carved up, rather than being
+	 * split down separately for every block handed out.  This never reclaims, so nothing can
+	 * free into the per-CPU cache while it runs.
+	 * @return Returns the number of blocks allocated, which is less than count if memory ran out.
+	 */
+	unsigned int allocate_blocks(int order, unsigned int count, PageDescriptor **pages, PageMobility mobility, void *caller)
+	{
+		AllOrdersLock l(*this);
+
+		unsigned int nr_blocks = 0;
+		while (nr_blocks < count) {
+			int source_order;
+			PageDescriptor *block = find_block(order, mobility, local_node(), source_order);
+			if (!block) break;
+
+			// Blocks that are already the right size are handed out as they are.
+			remove_block(block, source_order);
+			if (source_order == order) {
+				mark_allocated(block, order);
+				pages[nr_blocks++] = block;
+				continue;
+			}
+
+			// Hand out as much of a larger block as is needed, and free the tail.
+			uint64_t nr_carved = pages_per_block(source_order - order);
+			if (nr_carved > count - nr_blocks) nr_carved = count - nr_blocks;
+
+			for (uint64_t i = 0; i < nr_carved; i++) {
+				mark_allocated(block + (i << order), order);
+				pages[nr_blocks++] = block + (i << order);
+			}
+
+			free_range(block + (nr_carved << order), pages_per_block(source_order) - (nr_carved << order), caller);
+		}
+
+		return nr_blocks;
+	}
+
+	/**
+	 * Pops the hottest page off the per-CPU cache, refilling the cache from the buddy lists
+	 * when it has run dry.  If the buddy lists have nothing to refill it with, the page comes
+	 * from the usual allocation path, which can drain, reclaim and compact.
+	 */
+	PageDescriptor *pcp_allocate(void *caller)
+	{
+		PageDescriptor *pgd = NULL;
+		bool refilled = false;
+
+		{
+			UniqueIRQLock l;
+
+			if (_pcp.count == 0) {
+				_pcp.count = allocate_blocks(0, PCP_BATCH, _pcp.pages, MOBILITY_UNMOVABLE, caller);
+				refilled = true;
+			}
+
+			if (_pcp.count > 0) {
+				pgd = _pcp.pages[--_pcp.count];
+				pgd->next_free = ALLOCATED_POISON;
+			}
+		}
+
+		if (!pgd) return allocate(0, MOBILITY_UNMOVABLE, local_node(), caller);
+
+		// Reclaim can free pages back into the cache, so it only runs once the refill is done.
+		if (refilled) check_watermarks();
+
+		return pgd;
+	}
+
+	/**
+	 * Pushes a page onto the hot end of the per-CPU cache, draining a batch of cold pages once
+	 * the cache goes over its high watermark.
+	 */
+	void pcp_free(PageDescriptor *pgd, void *caller)
+	{
+		UniqueIRQLock l;
+
+		// Cached pages are free as far as the caller is concerned, so freeing one again must fail.
+		pgd->next_free = NULL;
+
+		_pcp.pages[_pcp.count++] = pgd;
+		if (_pcp.count > PCP_HIGH) {
+			pcp_drain(PCP_BATCH, caller);
+		}
+	}
+
+	/**
+	 * Returns the coldest pages in the per-CPU cache to the buddy lists.
+	 * @param nr_pages The number of pages to drain.
+	 */
+	void pcp_drain(unsigned int nr_pages, void *caller)
+	{
+		UniqueIRQLock l;
+
+		if (nr_pages > _pcp.count) nr_pages = _pcp.count;
+
+		{
+			AllOrdersLock ol(*this);
+
+			for (unsigned int i = 0; i < nr_pages; i++) {
+				free_block(_pcp.pages[i], 0, caller);
+			}
+		}
+
+		for (unsigned int i = nr_pages; i < _pcp.count; i++) {
+			_pcp.pages[i - nr_pages] = _pcp.pages[i];
+		}
+
+		_pcp.count -= nr_pages;
+	}
+
+	/**
+	 * Allocates a block for one of the public entry points, falling back on draining the caches
+	 * and compaction before giving up.
+	 * @return Returns the block, or NULL if allocation failed.
+	 */
+	PageDescriptor *allocate(int order, PageMobility mobility, unsigned int node, void *caller)
+	{
+		if (order < 0 || order > max_order) return NULL;
+
+		PageDescriptor *pgd = allocate_any_block(order, mobility, node, caller);
+
+		// Pages parked in the caches may be all that stops a larger block from forming.
+		if (!pgd && drain_caches(caller)) {
+			pgd = allocate_any_block(order, mobility, node, caller);
+		}
+
+		// Failing that, the shrinkers may be able to give back enough for the block.
+		if (!pgd && _nr_shrinkers && reclaim(nr_free_pages() + pages_per_block(order))) {
+			pgd = allocate_any_block(order, mobility, node, caller);
+		}
+
+		// Huge allocations get one bounded, synchronous go at compaction, and leave the daemon
+		// to rebuild more blocks of that order for next time.
+		if (!pgd && order >= COMPACTION_ORDER && _migrator) {
+			if (compact(order, COMPACTION_SYNC_MAX_PAGES, caller)) {
+				pgd = allocate_any_block(order, mobility, node, caller);
+			}
+
+			UniqueIRQLock l;
+
+			_compaction_request = order;
+			wake_daemon(_compaction_daemon, &compaction_daemon_entry);
+		}
+
+		if (pgd) count_allocation(pgd, node);
+
+		check_watermarks();
+		return pgd;
+	}
+
+	/** Counts an allocation as local or remote, against the node it preferred. */
+	void count_allocation(const PageDescriptor *pgd, unsigned int node)
+	{
+		__atomic_add_fetch(node_of(pgd_to_pfn(pgd)) == node ? &_nr_local_allocs : &_nr_remote_allocs, 1, __ATOMIC_RELAXED);
+	}
+
+	/** Logs a free that has been refused, with the caller responsible for it. */
+	bool report_bad_free(pfn_t pfn, uint64_t nr_pages, const char *what, void *caller) const
+	{
+		mm_log.messagef(LogLevel::ERROR, "buddy: bad free of %lu pages at pfn %lx from %p: %s", nr_pages, pfn, caller, what);
+		return false;
+	}
+
+	/**
+	 * Checks that a run of pages being freed was handed out by us and is not free already.  The
+	 * checks on the head cost a couple of reads and always run; with pgalloc.debug=1, every page
+	 * of the run is also checked against the free blocks.  The caller holds every order lock.
+	 * @return Returns TRUE if the run can be freed, or FALSE if the free has been reported and
+	 * must be dropped.
+	 */
+	bool check_free_locked(PageDescriptor *pgd, uint64_t nr_pages, void *caller) const
+	{
+		pfn_t pfn = pgd_to_pfn(pgd);
+
+		if (pfn >= _nr_pfns || nr_pages > _nr_pfns - pfn) return report_bad_free(pfn, nr_pages, "out of range", caller);
+		if (pfn & (pages_per_block(order_for(nr_pages)) - 1)) return report_bad_free(pfn, nr_pages, "misaligned", caller);
+		if (pgd->next_free != ALLOCATED_POISON) return report_bad_free(pfn, nr_pages, "already free, or never allocated", caller);
+
+		if (__builtin_expect(pgalloc_debug, 0)) {
+			int order;
+			if (find_free_block(pfn, order)) return report_bad_free(pfn, nr_pages, "inside a free block", caller);
+
+			for (pfn_t tail = pfn + 1; tail < pfn + nr_pages; tail++) {
+				if (free_info[tail].order != NOT_FREE) return report_bad_free(pfn, nr_pages, "overlaps a free block", caller);
+			}
+		}
+
+		return true;
+	}
+
+	/** Checks a run of pages being freed, as check_free_locked() does, taking the locks it needs. */
+	bool check_free(PageDescriptor *pgd, uint64_t nr_pages, void *caller) const
+	{
+		if (__builtin_expect(pgalloc_debug, 0)) {
+			AllOrdersLock l(*this);
+			return check_free_locked(pgd, nr_pages, caller);
+		}
+
+		return check_free_locked(pgd, nr_pages, caller);
+	}
+
+	/**
+	 * Frees a block for one of the public entry points, after checking that it really is an
+	 * allocated block.
+	 * @param caller The return address of the entry point, for reporting bad frees.
+	 */
+	void deallocate(PageDescriptor *pgd, int order, void *caller)
+	{
+		uint64_t start_tsc = trace_begin();
+
+		// Every block is handed out with its order recorded, so a block without one was never
+		// handed out, or is a run that has to go back through free_contiguous().
+		pfn_t pfn = pgd_to_pfn(pgd);
+		int allocated_order = pfn < _nr_pfns ? free_info[pfn].alloc_order : NOT_FREE;
+
+		// A block that is being migrated is freed by compaction once the migrator is done.
+		if (allocated_order == MIGRATING) {
+			AllOrdersLock l(*this);
+
+			allocated_order = free_info[pfn].alloc_order;
+			if (allocated_order == MIGRATING) {
+				_migration_freed = true;
+				return;
+			}
+		}
+
+		if (allocated_order == NOT_FREE || allocated_order == CONTIGUOUS_RUN || allocated_order == HUGE_PAGE) {
+			report_bad_free(pfn, 0, allocated_order == NOT_FREE ? "not an allocated block" :
+				allocated_order == CONTIGUOUS_RUN ? "contiguous run freed as a block" : "huge page freed as a block", caller);
+			return;
+		}
+
+		// The order the block was handed out with wins over the one it is freed with.
+		if (allocated_order != order) {
+			mm_log.messagef(LogLevel::WARNING, "buddy: order %d block at %lx freed as order %d from %p", allocated_order, pfn, order, caller);
+			order = allocated_order;
+		}
+
+		if (order < 0 || order > max_order) {
+			report_bad_free(pfn, 0, "bad order", caller);
+			return;
+		}
+
+		if (!check_free(pgd, pages_per_block(order), caller)) return;
+
+		// The cache is only filled with kernel pages, so only pages from kernel pageblocks go back
+		// into it; anything else would be handed out again in the wrong pageblock type.
+		if (order == 0 && pgalloc_pcp && pageblock_mobility(pfn) == MOBILITY_UNMOVABLE) {
+			pcp_free(pgd, caller);
+		} else {
+			release_block(pgd, order, caller);
+		}
+
+		trace(TRACE_FREE, pgd, order, start_tsc, caller);
+		check_state("free_pages");
+	}
+
+	/** Logs an inconsistency found by check_state. */
+	bool report_corruption(const char *where, const char *what, pfn_t pfn, int order) const
+	{
+		mm_log.messagef(LogLevel::ERROR, "buddy: after %s: %s at pfn %lx order %d", where, what, pfn, order);
+		return false;
+	}
+
+	/**
+	 * Cross-checks the free lists and the free block table against one another: every
+	 * listed block is aligned, tagged and back-linked correctly, no two free blocks overlap, no
+	 * free block has a free buddy of the same order or is marked allocated, and the counts add
+	 * up.  This walks every page, so it only runs with pgalloc.check=1.
+	 * @param where The operation that has just completed, for the log.
+	 * @return Returns TRUE if the allocator state is consistent, FALSE otherwise.
+	 */
+	bool check_state(const char *where) const
+	{
+		if (__builtin_expect(!pgalloc_check, 1)) return true;
+
+		AllOrdersLock l(*this);
+
+		uint64_t nr_listed = 0;
+		for (unsigned int node = 0; node < _nr_nodes; node++) {
+			for (unsigned int mobility = 0; mobility < NR_FREE_LIST_TYPES; mobility++) {
+				for (int order = 0; order <= max_order; order++) {
+					pfn_t prev = NO_PFN;
+
+					for (PageDescriptor *pgd = _free_areas[node][mobility][order]; pgd; pgd = pgd->next_free) {
+						pfn_t pfn = pgd_to_pfn(pgd);
+						const FreeBlockInfo& info = free_info[pfn];
+
+						// A cycle in a list would otherwise keep us here forever.
+						if (++nr_listed > _nr_pfns) return report_corruption(where, "free list cycle", pfn, order);
+						if (pfn + pages_per_block(order) > _nr_pfns) return report_corruption(where, "block out of range", pfn, order);
+						if (!is_correct_alignment_for_order(pgd, order)) return report_corruption(where, "misaligned block", pfn, order);
+						if (info.order != order) return report_corruption(where, "block order mismatch", pfn, order);
+						if (info.mobility != mobility || node_of(pfn) != node) return report_corruption(where, "block list mismatch", pfn, order);
+						if (info.prev_free != prev) return report_corruption(where, "broken back-link", pfn, order);
+
+						prev = pfn;
+					}
+
+					if (policy == FREE_LIST_FIFO && _free_tails[node][mobility][order] != (prev == NO_PFN ? NULL : pfn_to_pgd(prev))) {
+						return report_corruption(where, "broken list tail", prev, order);
+					}
+				}
+			}
+		}
+
+		uint64_t nr_blocks[max_order+1] = { 0 };
+		uint64_t nr_heads = 0;
+		uint64_t nr_free = 0;
+
+		pfn_t pfn = 0;
+		while (pfn < _nr_pfns) {
+			int order = free_info[pfn].order;
+			if (order == NOT_FREE) {
+				pfn++;
+				continue;
+			}
+
+			if (order > max_order) return report_corruption(where, "bad block order", pfn, order);
+			if (!_free_bitmaps[order].test(pfn >> order)) return report_corruption(where, "free block missing from bitmap", pfn, order);
+			if (free_info[pfn].alloc_order != NOT_FREE) return report_corruption(where, "free block marked allocated", pfn, order);
+
+			pfn_t buddy_pfn = pfn ^ pages_per_block(order);
+			if (order < max_order && buddy_pfn < _nr_pfns && free_info[buddy_pfn].order == order) {
+				return report_corruption(where, "uncoalesced buddies", pfn, order);
+			}
+
+			pfn_t end = pfn + pages_per_block(order);
+			for (pfn_t tail = pfn + 1; tail < end && tail < _nr_pfns; tail++) {
+				if (free_info[tail].order != NOT_FREE) return report_corruption(where, "overlapping blocks", tail, free_info[tail].order);
+			}
+
+			nr_blocks[order]++;
+			nr_heads++;
+			nr_free += pages_per_block(order);
+			pfn = end;
+		}
+
+		if (nr_heads != nr_listed) return report_corruption(where, "free block not on a list", 0, -1);
+		if (nr_free != nr_free_pages()) return report_corruption(where, "free page count mismatch", 0, -1);
+
+		for (int order = 0; order <= max_order; order++) {
+			if (nr_blocks[order] != _nr_free_blocks[order]) return report_corruption(where, "free block count mismatch", 0, order);
+			if (nr_blocks[order] != _free_bitmaps[order].count()) return report_corruption(where, "free bitmap count mismatch", 0, order);
+		}
+
+		return true;
+	}
+
+public:
+	/**
+	 * Allocates 2^order number of contiguous pages
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages(int order) override
+	{
+		void *caller = __builtin_return_address(0);
+		uint64_t start_tsc = trace_begin();
+
+		// Everything coming through the generic interface is kernel memory.
+		PageDescriptor *pgd = order == 0 && pgalloc_pcp ? pcp_allocate(caller) : allocate(order, MOBILITY_UNMOVABLE, local_node(), caller);
+
+		trace(TRACE_ALLOCATE, pgd, order, start_tsc, caller);
+		check_state("allocate_pages");
+		return pgd;
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages, grouped with other allocations of the same
+	 * mobility type.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param mobility The mobility type of the allocation.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages(int order, PageMobility mobility) override
+	{
+		void *caller = __builtin_return_address(0);
+		uint64_t start_tsc = trace_begin();
+		PageDescriptor *pgd = allocate(order, mobility, local_node(), caller);
+
+		trace(TRACE_ALLOCATE, pgd, order, start_tsc, caller);
+		check_state("allocate_pages");
+		return pgd;
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages from the given memory node, falling back on
+	 * the other nodes in that node's fallback order.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param node The preferred node.
+	 * @param mobility The mobility type of the allocation.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages_node(int order, unsigned int node, PageMobility mobility = MOBILITY_UNMOVABLE) override
+	{
+		if (node >= _nr_nodes) return NULL;
+
+		void *caller = __builtin_return_address(0);
+		uint64_t start_tsc = trace_begin();
+		PageDescriptor *pgd = allocate(order, mobility, node, caller);
+
+		trace(TRACE_ALLOCATE, pgd, order, start_tsc, caller);
+		check_state("allocate_pages_node");
+		return pgd;
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages as close as possible to the given page, so
+	 * that, say, a page table can sit next to its parent.  If nothing is free, this falls back on
+	 * the usual allocation path, preferring the node the page is on.
+	 * @param pfn The page-frame-number to allocate near.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param mobility The mobility type of the allocation.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages_near(pfn_t pfn, int order, PageMobility mobility = MOBILITY_UNMOVABLE) override
+	{
+		if (order < 0 || order > max_order || pfn >= _nr_pfns) return NULL;
+
+		void *caller = __builtin_return_address(0);
+		uint64_t start_tsc = trace_begin();
+
+		PageDescriptor *pgd;
+		{
+			AllOrdersLock l(*this);
+			pgd = allocate_block_near(pfn, order, mobility, caller);
+		}
+
+		if (!pgd) {
+			pgd = allocate(order, mobility, node_of(pfn), caller);
+		} else {
+			count_allocation(pgd, node_of(pfn));
+			check_watermarks();
+		}
+
+		trace(TRACE_ALLOCATE, pgd, order, start_tsc, caller);
+		check_state("allocate_pages_near");
+		return pgd;
+	}
+
+	/**
+	 * Sets the order in which allocations preferring a node fall back on the other nodes.
+	 * @param node The preferred node.
+	 * @param nodes Every node, the preferred one usually first, in the order to try them.
+	 * @param count The number of entries in nodes, which must be the number of nodes.
+	 * @return Returns TRUE if the fallback order was set, FALSE if it is not a valid order.
+	 */
+	bool set_node_fallbacks(unsigned int node, const unsigned int *nodes, unsigned int count) override
+	{
+		if (node >= _nr_nodes || count != _nr_nodes) return false;
+
+		// Every node has to appear exactly once.
+		unsigned int seen = 0;
+		for (unsigned int i = 0; i < count; i++) {
+			if (nodes[i] >= _nr_nodes || (seen & (1u << nodes[i]))) return false;
+			seen |= 1u << nodes[i];
+		}
+
+		AllOrdersLock l(*this);
+
+		for (unsigned int i = 0; i < count; i++) {
+			_node_fallbacks[node][i] = nodes[i];
+		}
+
+		return true;
+	}
+
+	/**
+	 * Allocates any number of contiguous pages, not just a power of two.  The smallest block that
+	 * covers them is allocated, and the pages beyond count go straight back to the free lists as
+	 * the largest aligned blocks that fit.  The run is not a block, so it can only be freed with
+	 * free_contiguous().
+	 * @param count The number of contiguous pages to allocate.
+	 * @param mobility The mobility type of the allocation.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_contiguous(uint64_t count, PageMobility mobility = MOBILITY_UNMOVABLE) override
+	{
+		if (count == 0) return NULL;
+
+		int order = order_for(count);
+		if (order > max_order) return NULL;
 
-/**
- * A buddy page allocation algorithm.
- */
-class BuddyPageAllocator : public PageAllocatorAlgorithm
-{
-private:
-	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
-	 * to the left or the right of PGD, in the given order.
-	 * @param pgd The page descriptor to find the buddy for.
-	 * @param order The order in which the page descriptor lives.
-	 * @return Returns the buddy of the given page descriptor, in the given order.
+		void *caller = __builtin_return_address(0);
+		uint64_t start_tsc = trace_begin();
+		PageDescriptor *pgd = allocate(order, mobility, local_node(), caller);
+
+		if (pgd) {
+			AllOrdersLock l(*this);
+			free_range(pgd + count, pages_per_block(order) - count, caller);
+
+			// What is left is not a block, so record its length for free_contiguous() to check
+			// against, in place of an order.
+			FreeBlockInfo& info = free_info[pgd_to_pfn(pgd)];
+			info.alloc_order = CONTIGUOUS_RUN;
+			info.prev_free = count;
+		}
+
+		trace(TRACE_ALLOCATE, pgd, order, start_tsc, caller);
+		check_state("allocate_contiguous");
+		return pgd;
+	}
+
+	/**
+	 * Frees a run of pages from allocate_contiguous(), coalescing each aligned block in it with
+	 * its neighbours.
+	 * @param pgd The first page of the run.
+	 * @param count The number of pages in the run, as passed to allocate_contiguous().
 	 */
-	PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
+	void free_contiguous(PageDescriptor *pgd, uint64_t count) override
 	{
-        // TODO: Implement me!
+		void *caller = __builtin_return_address(0);
+
+		pfn_t pfn = pgd_to_pfn(pgd);
+		if (pfn >= _nr_pfns || free_info[pfn].alloc_order != CONTIGUOUS_RUN) {
+			report_bad_free(pfn, count, "not a contiguous run", caller);
+			return;
+		}
+
+		if (free_info[pfn].prev_free != count) {
+			report_bad_free(pfn, count, "wrong length for the contiguous run", caller);
+			return;
+		}
+
+		if (!check_free(pgd, count, caller)) return;
+
+		uint64_t start_tsc = trace_begin();
+
+		{
+			AllOrdersLock l(*this);
+			free_range(pgd, count, caller);
+		}
+
+		trace(TRACE_FREE, pgd, order_for(count), start_tsc, caller);
+		check_state("free_contiguous");
 	}
 
 	/**
-	 * Given a pointer to a block of free memory in the order "source_order", this function will
-	 * split the block in half, and insert it into the order below.
-	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
-	 * @param source_order The order in which the block of free memory exists.  Naturally,
-	 * the split will insert the two new blocks into the order below.
-	 * @return Returns the left-hand-side of the new block.
+	 * Allocates a 2 MiB page from the huge page pool reserved at boot.  This never splits or
+	 * merges anything; once the pool is empty, it fails.
+	 * @return Returns a pointer to the first page descriptor of the huge page, or NULL if the pool
+	 * is empty.
 	 */
-	PageDescriptor *split_block(PageDescriptor **block_pointer, int source_order)
+	PageDescriptor *allocate_huge_page() override
 	{
-        // TODO: Implement me!
+		void *caller = __builtin_return_address(0);
+		uint64_t start_tsc = trace_begin();
+		PageDescriptor *pgd;
+
+		{
+			UniqueIRQLock l;
+			_huge_pool_lock.lock();
+
+			pgd = _huge_pool;
+			if (pgd) {
+				_huge_pool = pgd->next_free;
+				_nr_free_huge_pages--;
+				pgd->next_free = ALLOCATED_POISON;
+			} else {
+				_nr_huge_page_failures++;
+			}
+
+			_huge_pool_lock.unlock();
+		}
+
+		trace(TRACE_ALLOCATE, pgd, HUGE_PAGE_ORDER, start_tsc, caller);
+		return pgd;
 	}
 
 	/**
-	 * Takes a block in the given source order, and merges it (and its buddy) into the next order.
-	 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
-	 * @param source_order The order in which the pair of blocks live.
-	 * @return Returns the new slot that points to the merged block.
+	 * Returns a huge page to the pool it came from.  Anything that did not come from the pool is
+	 * turned away.
+	 * @param pgd The first page descriptor of the huge page.
 	 */
-	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order)
+	void free_huge_page(PageDescriptor *pgd) override
 	{
-        // TODO: Implement me!
+		void *caller = __builtin_return_address(0);
+
+		pfn_t pfn = pgd_to_pfn(pgd);
+		if (pfn >= _nr_pfns || free_info[pfn].alloc_order != HUGE_PAGE) {
+			report_bad_free(pfn, pages_per_block(HUGE_PAGE_ORDER), "not a huge page", caller);
+			return;
+		}
+
+		if (!check_free(pgd, pages_per_block(HUGE_PAGE_ORDER), caller)) return;
+
+		uint64_t start_tsc = trace_begin();
+
+		{
+			UniqueIRQLock l;
+			_huge_pool_lock.lock();
+
+			pgd->next_free = _huge_pool;
+			_huge_pool = pgd;
+			_nr_free_huge_pages++;
+
+			_huge_pool_lock.unlock();
+		}
+
+		trace(TRACE_FREE, pgd, HUGE_PAGE_ORDER, start_tsc, caller);
 	}
 
-public:
 	/**
-	 * Allocates 2^order number of contiguous pages
+	 * Registers a callback the allocator can ask to free memory when free memory runs low.
+	 * @return Returns TRUE if the shrinker was registered, FALSE if there is no room for it.
+	 */
+	bool register_shrinker(PageShrinker shrinker) override
+	{
+		UniqueIRQLock l;
+
+		if (_nr_shrinkers >= MAX_SHRINKERS) return false;
+
+		_shrinkers[_nr_shrinkers++] = shrinker;
+		return true;
+	}
+
+	/** Returns the number of pages on the buddy lists. */
+	uint64_t nr_free_pages() const override
+	{
+		return __atomic_load_n(&_nr_free_pages, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Returns the number of free pages held back from the buddy lists: in the per-CPU cache,
+	 * the zeroed pools and the huge page pool.  The counts are read without the locks, so this
+	 * is only exact while nothing else is allocating.
+	 */
+	uint64_t nr_cached_pages() const override
+	{
+		uint64_t nr_pages = __atomic_load_n(&_pcp.count, __ATOMIC_RELAXED);
+
+		for (int order = 0; order <= ZERO_POOL_MAX_ORDER; order++) {
+			nr_pages += (uint64_t)__atomic_load_n(&_nr_zeroed[order], __ATOMIC_RELAXED) << order;
+		}
+
+		return nr_pages + (__atomic_load_n(&_nr_free_huge_pages, __ATOMIC_RELAXED) << HUGE_PAGE_ORDER);
+	}
+
+	/**
+	 * Registers the migrator compaction uses to move allocated blocks.  Until one is registered,
+	 * compaction is disabled.
+	 */
+	void register_page_migrator(PageMigrator migrator) override
+	{
+		_migrator = migrator;
+	}
+
+	/**
+	 * Tops up every zeroed pool to its target now, as the zeroing daemon would in the
+	 * background, say to have them ready before the first process starts.
+	 * @return Returns the number of blocks added.
+	 */
+	unsigned int fill_zero_pools() override
+	{
+		unsigned int nr_blocks = 0;
+		while (zero_pool_refill_one()) nr_blocks++;
+
+		return nr_blocks;
+	}
+
+	/**
+	 * Allocates 2^order contiguous, zero-filled pages for user memory.  Blocks come from the
+	 * pool the zeroing daemon fills in the background where possible, and are zeroed inline
+	 * otherwise.
 	 * @param order The power of two, of the number of contiguous pages to allocate.
 	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
 	 * allocation failed.
 	 */
-	PageDescriptor *allocate_pages(int order) override
+	PageDescriptor *allocate_zeroed_pages(int order) override
 	{
-        // TODO: Implement me!
+		void *caller = __builtin_return_address(0);
+		uint64_t start_tsc = trace_begin();
+
+		PageDescriptor *block = NULL;
+		if (order <= ZERO_POOL_MAX_ORDER) {
+			UniqueIRQLock l;
+
+			// The pool only starts being filled once somebody wants zeroed pages, and is topped
+			// up again as they are taken.
+			_zero_pool_requested = true;
+			wake_daemon(_zeroing_daemon, &zeroing_daemon_entry);
+
+			block = _zeroed[order];
+			if (block) {
+				_zeroed[order] = block->next_free;
+				_nr_zeroed[order]--;
+
+				block->next_free = ALLOCATED_POISON;
+			}
+		}
+
+		if (!block) {
+			block = allocate(order, MOBILITY_MOVABLE, local_node(), caller);
+			if (block) {
+				memset(pgd_to_vpa(block), 0, pages_per_block(order) << PAGE_SHIFT);
+			}
+		}
+
+		trace(TRACE_ALLOCATE, block, order, start_tsc, caller);
+		check_state("allocate_zeroed_pages");
+		return block;
 	}
 
     /**
@@ -76,9 +2549,63 @@ public:
 	 */
     void free_pages(PageDescriptor *pgd, int order) override
     {
-        // TODO: Implement me!
+        deallocate(pgd, order, __builtin_return_address(0));
     }
 
+	/**
+	 * Frees a block, going by the order it was allocated with.
+	 * @param pgd The first page descriptor of the block.
+	 */
+	void free_pages(PageDescriptor *pgd) override
+	{
+		pfn_t pfn = pgd_to_pfn(pgd);
+		int order = pfn < _nr_pfns ? free_info[pfn].alloc_order : NOT_FREE;
+
+		// Anything without a real order is turned away by deallocate().
+		deallocate(pgd, order, __builtin_return_address(0));
+	}
+
+	/**
+	 * Allocates a batch of blocks of the same order in one go.  A larger block is split once and
+	 * carved up, rather than being split down separately for every block handed out.
+	 * @param order The order of the blocks to allocate.
+	 * @param count The number of blocks to allocate.
+	 * @param pages The array to store the allocated blocks in.
+	 * @param mobility The mobility type of the allocations.
+	 * @return Returns the number of blocks allocated, which is less than count if memory ran out.
+	 */
+	unsigned int allocate_pages_bulk(int order, unsigned int count, PageDescriptor **pages, PageMobility mobility = MOBILITY_UNMOVABLE) override
+	{
+		if (order < 0 || order > max_order) return 0;
+
+		unsigned int nr_blocks;
+		{
+			UniqueIRQLock l;
+			nr_blocks = allocate_blocks(order, count, pages, mobility, __builtin_return_address(0));
+		}
+
+		check_watermarks();
+		check_state("allocate_pages_bulk");
+		return nr_blocks;
+	}
+
+	/**
+	 * Frees a batch of blocks of the same order.  Each one is freed as free_pages() would free
+	 * it, so it is checked against the order it was allocated with, goes through the per-CPU
+	 * cache, and is traced.
+	 * @param order The order of the blocks to free.
+	 * @param count The number of blocks to free.
+	 * @param pages The blocks to free.
+	 */
+	void free_pages_bulk(int order, unsigned int count, PageDescriptor **pages) override
+	{
+		void *caller = __builtin_return_address(0);
+
+		for (unsigned int i = 0; i < count; i++) {
+			deallocate(pages[i], order, caller);
+		}
+	}
+
     /**
      * Marks a range of pages as available for allocation.
      * @param start A pointer to the first page descriptors to be made available.
@@ -86,7 +2613,41 @@ public:
      */
     virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
     {
-        // TODO: Implement me!
+        uint64_t start_cycles = rdtsc();
+        void *caller = __builtin_return_address(0);
+
+        pfn_t pfn = pgd_to_pfn(start);
+
+        // The page descriptors of hot-added memory carry on from the array handed to init().
+        // Their entries are set up before anything is locked, so that the time spent with
+        // interrupts off and every lock held does not grow with the amount of memory added.
+        _grow_lock.lock();
+
+        pfn_t end = pfn + count > _nr_pfns ? prepare_growth(pfn + count) : _nr_pfns;
+
+        {
+            // This can be called at any time to hot-add memory, so it must not be interrupted by
+            // an allocation with every lock held.
+            AllOrdersLock l(*this);
+
+            grow_to(end);
+
+            if (pfn < _nr_pfns) {
+                if (pfn + count > _nr_pfns) count = _nr_pfns - pfn;
+
+                // Freeing coalesces the new blocks with any free neighbours, up to max_order.
+                free_range(start, count, caller);
+                huge_pool_fill(caller);
+            } else {
+                count = 0;
+            }
+        }
+
+        _grow_lock.unlock();
+
+        check_state("insert_page_range");
+
+        mm_log.messagef(LogLevel::DEBUG, "buddy: inserted %lu pages at %lx in %lu cycles", count, pfn, rdtsc() - start_cycles);
     }
 
     /**
@@ -96,7 +2657,52 @@ public:
      */
     virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
     {
-        // TODO: Implement me!
+        void *caller = __builtin_return_address(0);
+
+        // Cached pages are invisible to the buddy lists, so hand them back first.
+        drain_caches(caller);
+
+        {
+            AllOrdersLock l(*this);
+
+            pfn_t pfn = pgd_to_pfn(start);
+            pfn_t end = pfn + count;
+            if (end > _nr_pfns) end = _nr_pfns;
+
+            huge_pool_remove_range(pfn, end, caller);
+
+            while (pfn < end) {
+                int order;
+                PageDescriptor *block = find_free_block(pfn, order);
+                if (!block) {
+                    pfn++;
+                    continue;
+                }
+
+                // Take the whole block, then give back whatever lies outside the range, in blocks
+                // as large as alignment allows.
+                remove_block(block, order);
+
+                pfn_t block_start = pgd_to_pfn(block);
+                pfn_t block_end = block_start + pages_per_block(order);
+
+                if (block_start < pfn) {
+                    free_range(block, pfn - block_start, caller);
+                }
+
+                if (block_end > end) {
+                    free_range(pfn_to_pgd(end), block_end - end, caller);
+                    block_end = end;
+                }
+
+                pfn = block_end;
+            }
+
+            // Replace whatever the pool lost from elsewhere.
+            huge_pool_fill(caller);
+        }
+
+        check_state("remove_page_range");
     }
 
 	/**
@@ -105,7 +2711,127 @@ public:
 	 */
 	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
 	{
-        // TODO: Implement me!
+		uint64_t start_cycles = rdtsc();
+
+		active_allocator = this;
+
+		_page_descriptors = page_descriptors;
+		_nr_pfns = nr_page_descriptors;
+		if (_nr_pfns > MAX_PFNS) {
+			mm_log.messagef(LogLevel::WARNING, "buddy: only managing the first %lu of %lu pages", MAX_PFNS, nr_page_descriptors);
+			_nr_pfns = MAX_PFNS;
+		}
+
+		// Split memory into as many nodes as were asked for, each a power of two pages long.
+		_node_shift = max_order;
+		while (_nr_pfns && ((_nr_pfns - 1) >> _node_shift) + 1 > pgalloc_nodes) {
+			_node_shift++;
+		}
+
+		// Without NUMA, memory hot-added later on belongs to the one node too.
+		if (pgalloc_nodes == 1) {
+			while (pages_per_block(_node_shift) < MAX_PFNS) _node_shift++;
+		}
+
+		_nr_nodes = _nr_pfns ? ((_nr_pfns - 1) >> _node_shift) + 1 : 1;
+
+		for (unsigned int node = 0; node < MAX_NODES; node++) {
+			for (unsigned int mobility = 0; mobility < NR_FREE_LIST_TYPES; mobility++) {
+				for (unsigned int order = 0; order <= max_order; order++) {
+					_free_areas[node][mobility][order] = NULL;
+					_free_tails[node][mobility][order] = NULL;
+				}
+			}
+		}
+
+		for (unsigned int node = 0; node < _nr_nodes; node++) {
+			set_default_fallbacks(node, _nr_nodes);
+		}
+
+		_nr_local_allocs = 0;
+		_nr_remote_allocs = 0;
+
+		_huge_pool = NULL;
+		_nr_huge_pages = 0;
+		_nr_free_huge_pages = 0;
+		_nr_huge_page_failures = 0;
+
+		for (unsigned int order = 0; order <= max_order; order++) {
+			_nr_free_blocks[order] = 0;
+		}
+
+		_nr_free_pages = 0;
+		set_watermarks();
+
+		for (unsigned int i = 0; i < nr_registered_shrinkers; i++) {
+			_shrinkers[i] = registered_shrinkers[i];
+		}
+
+		_nr_shrinkers = nr_registered_shrinkers;
+		_reclaiming = false;
+		_direct_reclaim_stalled = false;
+		_reclaim_requested = false;
+		_reclaim_daemon = NULL;
+
+		// Everything starts out movable; kernel allocations claim pageblocks as they need them.
+		for (unsigned int i = 0; i < ARRAY_SIZE(pageblock_mobilities); i++) {
+			pageblock_mobilities[i] = MOBILITY_MOVABLE;
+		}
+
+		for (pfn_t pfn = 0; pfn < _nr_pfns; pfn++) {
+			free_info[pfn].order = NOT_FREE;
+			free_info[pfn].alloc_order = NOT_FREE;
+		}
+
+		// Lay the per-order bitmaps out one after another, each with room for MAX_PFNS pages, so
+		// that they can grow in place when memory is hot-added.
+		uint64_t *words = free_bitmap_words;
+		uint64_t *summary = free_bitmap_summary;
+		for (int order = 0; order <= max_order; order++) {
+			uint64_t max_bits = MAX_PFNS >> order;
+
+			_free_bitmaps[order].init(words, summary, max_bits, (_nr_pfns + pages_per_block(order) - 1) >> order);
+			words += BlockBitmap::words_for(max_bits);
+			summary += BlockBitmap::words_for(BlockBitmap::words_for(max_bits));
+		}
+
+		_pcp.count = 0;
+		_migrator = NULL;
+		_compacting = false;
+		_migration_freed = false;
+		_compaction_request = 0;
+		_compaction_daemon = NULL;
+
+		for (int order = 0; order <= ZERO_POOL_MAX_ORDER; order++) {
+			_zeroed[order] = NULL;
+			_nr_zeroed[order] = 0;
+		}
+
+		_zero_pool_requested = false;
+		_zeroing_daemon = NULL;
+
+		trace_ring.head = 0;
+
+		mm_log.messagef(LogLevel::DEBUG, "buddy: initialised for %lu pages on %u nodes in %lu cycles", _nr_pfns, _nr_nodes, rdtsc() - start_cycles);
+		return true;
+	}
+
+	/**
+	 * Writes the trace ring out of the debugcon port, oldest event first, one "pgtrace" line per
+	 * event.  decode-pgtrace.sh turns the output into per-order statistics.
+	 */
+	void dump_trace() const
+	{
+		uint64_t head = __atomic_load_n(&trace_ring.head, __ATOMIC_RELAXED);
+		uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		for (uint64_t i = first; i < head; i++) {
+			const TraceEvent& event = trace_ring.events[i % TRACE_RING_SIZE];
+
+			char line[96];
+			format_trace_event(event, line, sizeof(line));
+			debugcon_write(line);
+		}
 	}
 
 	/**
@@ -114,35 +2840,257 @@ public:
 	const char* name() const override { return "buddy"; }
 
 	/**
-	 * Dumps out the current state of the buddy system
+	 * Dumps out the current state of the buddy system: a summary of the free block counts
+	 * first, then either every free block, list by list, or with pgalloc.dump=compact, free
+	 * memory as run-length encoded "pfn+count" ranges in address order.  Nothing is logged
+	 * with a lock held: the state is copied out a piece at a time, and each piece is logged
+	 * once the locks are dropped, so the dump is not one consistent snapshot.
 	 */
 	void dump_state() const override
 	{
+		uint64_t nr_free_blocks[max_order+1];
+		for (int order = 0; order <= max_order; order++) {
+			UniqueIRQLock l;
+
+			_order_locks[order].lock();
+			nr_free_blocks[order] = _nr_free_blocks[order];
+			_order_locks[order].unlock();
+		}
+
 		// Print out a header, so we can find the output in the logs.
 		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
 
-		// Iterate over each free area.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			char buffer[256];
-			snprintf(buffer, sizeof(buffer), "[%d] ", i);
+		LogLineBuilder counts("blocks: ");
+		for (int order = 0; order <= max_order; order++) {
+			counts.appendf("[%d]=%lu ", order, nr_free_blocks[order]);
+		}
+
+		mm_log.messagef(LogLevel::DEBUG, "free pages: %lu (min %lu, low %lu, high %lu)",
+			nr_free_pages(), _watermark_min, _watermark_low, _watermark_high);
+		counts.flush();
 
-			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
-			while (pg) {
-				// Append the PFN of the free block to the output buffer.
-				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
-				pg = pg->next_free;
-			}
+		mm_log.messagef(LogLevel::DEBUG, "[numa] %u nodes of %lu pages, %lu local / %lu remote allocations",
+			_nr_nodes, pages_per_block(_node_shift), _nr_local_allocs, _nr_remote_allocs);
+		mm_log.messagef(LogLevel::DEBUG, "[huge] %lu of %lu pages free, %lu failed allocations",
+			_nr_free_huge_pages, _nr_huge_pages, _nr_huge_page_failures);
+		mm_log.messagef(LogLevel::DEBUG, "[pcp] %u pages", _pcp.count);
+
+		// How much of the free memory is in blocks too small for a huge page.
+		uint64_t nr_huge_free = 0;
+		for (int order = HUGE_PAGE_ORDER; order <= max_order; order++) {
+			nr_huge_free += nr_free_blocks[order] << order;
+		}
+
+		uint64_t nr_free = nr_free_pages();
+		mm_log.messagef(LogLevel::DEBUG, "[frag] %s allocation, %lu%% of free pages unusable for order %d",
+			free_list_policy_names[address_ordered() ? FREE_LIST_ADDRESS_ORDERED : policy], nr_free ? (nr_free - nr_huge_free) * 100 / nr_free : 0, HUGE_PAGE_ORDER);
+
+		for (int order = 0; order <= ZERO_POOL_MAX_ORDER; order++) {
+			mm_log.messagef(LogLevel::DEBUG, "[zeroed %d] %u blocks", order, _nr_zeroed[order]);
+		}
+
+		if (pgalloc_dump_compact) {
+			dump_free_ranges();
+		} else {
+			dump_free_lists();
+		}
+
+		if (pgalloc_debug) {
+			dump_trace();
+		}
+	}
+
+	/**
+	 * Dumps every free block, list by list.  Each list is copied out DUMP_CHUNK blocks at a
+	 * time under its order's lock.  If the block a chunk stopped at has left the list by the
+	 * time the next one is copied, the rest of the list is skipped and marked as changed.
+	 */
+	void dump_free_lists() const
+	{
+		// Iterate over each free area, of each mobility type, on each node.
+		for (unsigned int node = 0; node < _nr_nodes; node++) {
+			for (unsigned int mobility = 0; mobility < NR_FREE_LIST_TYPES; mobility++) {
+				mm_log.messagef(LogLevel::DEBUG, "node %u %s:", node, mobility_names[mobility]);
+
+				for (int order = 0; order <= max_order; order++) {
+					char prefix[8];
+					snprintf(prefix, sizeof(prefix), "[%d] ", order);
+
+					LogLineBuilder line(prefix);
+					const PageDescriptor *resume = NULL;	// where the last chunk stopped
+
+					do {
+						pfn_t chunk[DUMP_CHUNK];
+						unsigned int nr_blocks = 0;
+						bool changed = false;
+
+						{
+							UniqueIRQLock l;
+							_order_locks[order].lock();
+
+							const PageDescriptor *pg = resume ? resume : _free_areas[node][mobility][order];
+							if (resume) {
+								const FreeBlockInfo& info = free_info[pgd_to_pfn(resume)];
+								changed = info.order != order || info.mobility != mobility || node_of(pgd_to_pfn(resume)) != node;
+								if (changed) pg = NULL;
+							}
+
+							for (; pg && nr_blocks < DUMP_CHUNK; pg = pg->next_free) {
+								chunk[nr_blocks++] = pgd_to_pfn(pg);
+							}
 
-			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+							resume = pg;
+							_order_locks[order].unlock();
+						}
+
+						for (unsigned int i = 0; i < nr_blocks; i++) {
+							line.appendf("%lx ", chunk[i]);
+						}
+
+						if (changed) line.appendf("(changed)");
+					} while (resume);
+
+					line.flush();
+				}
+			}
 		}
 	}
 
+	/**
+	 * Dumps free memory as runs of free pages, in address order.  The runs are found DUMP_CHUNK
+	 * at a time with every order lock held, carrying on from the end of the last one.
+	 */
+	void dump_free_ranges() const
+	{
+		LogLineBuilder line("free: ");
+
+		pfn_t pfn = 0;
+		bool more = true;
+		while (more) {
+			pfn_t starts[DUMP_CHUNK], ends[DUMP_CHUNK];
+			unsigned int nr_runs = 0;
+
+			{
+				AllOrdersLock l(*this);
+
+				while (pfn < _nr_pfns && nr_runs < DUMP_CHUNK) {
+					if (free_info[pfn].order == NOT_FREE) {
+						pfn++;
+						continue;
+					}
+
+					// Run adjacent free blocks together.
+					starts[nr_runs] = pfn;
+					while (pfn < _nr_pfns && free_info[pfn].order != NOT_FREE) {
+						pfn += pages_per_block(free_info[pfn].order);
+					}
+
+					ends[nr_runs++] = pfn;
+				}
+
+				more = pfn < _nr_pfns;
+			}
+
+			for (unsigned int i = 0; i < nr_runs; i++) {
+				line.appendf("%lx+%lx ", starts[i], ends[i] - starts[i]);
+			}
+		}
+
+		line.flush();
+	}
 
 private:
-	PageDescriptor *_free_areas[MAX_ORDER+1];
+	PageDescriptor *_free_areas[MAX_NODES][NR_FREE_LIST_TYPES][max_order+1];
+	PageDescriptor *_free_tails[MAX_NODES][NR_FREE_LIST_TYPES][max_order+1];	// only kept for FIFO
+
+	unsigned int _nr_nodes;
+	unsigned int _node_shift;
+	unsigned int _node_fallbacks[MAX_NODES][MAX_NODES];
+	uint64_t _nr_local_allocs;
+	uint64_t _nr_remote_allocs;
+
+	SpinLock _huge_pool_lock;
+	PageDescriptor *_huge_pool;
+	uint64_t _nr_huge_pages;
+	uint64_t _nr_free_huge_pages;
+	uint64_t _nr_huge_page_failures;
+
+	PageDescriptor *_page_descriptors;
+	uint64_t _nr_pfns;
+	SpinLock _grow_lock;		// serialises hot-adds past the end of the range; never taken by an allocation or free
+	uint64_t _nr_free_blocks[max_order+1];
+
+	/*
+	 * One lock per order, covering that order's free lists and block count.  The allocation
+	 * and free fast paths never hold more than one at a time, and anything that works across
+	 * orders takes all of them, lowest first, so there is no lock order to get wrong.
+	 */
+	mutable SpinLock _order_locks[max_order+1];
+
+	/*
+	 * A bitmap per order of which blocks of that order are free, indexed by PFN >> order, for
+	 * finding the free block nearest to a page without walking the lists.  Each is covered by
+	 * the lock of its order.
+	 */
+	BlockBitmap _free_bitmaps[max_order+1];
+
+	// InfOS only brings up the boot processor, so there is a single per-CPU cache.
+	PageCache _pcp;
+
+	PageMigrator _migrator;
+	bool _compacting;
+	bool _migration_freed;		// the block being migrated was freed by its owner
+	volatile int _compaction_request;
+	Thread *_compaction_daemon;
+
+	uint64_t _nr_free_pages;
+	uint64_t _watermark_min;
+	uint64_t _watermark_low;
+	uint64_t _watermark_high;
+
+	PageShrinker _shrinkers[MAX_SHRINKERS];
+	unsigned int _nr_shrinkers;
+	bool _reclaiming;
+	bool _direct_reclaim_stalled;
+	volatile bool _reclaim_requested;
+	Thread *_reclaim_daemon;
+
+	PageDescriptor *_zeroed[ZERO_POOL_MAX_ORDER+1];
+	unsigned int _nr_zeroed[ZERO_POOL_MAX_ORDER+1];
+	volatile bool _zero_pool_requested;
+	Thread *_zeroing_daemon;
+
 };
 
+/* The standard buddy allocator, which is the one registered below. */
+typedef BuddyAllocator<MAX_ORDER, FREE_LIST_LIFO> BuddyPageAllocator;
+
+/*
+ * Variants of the buddy allocator, for comparing geometries and free list policies with
+ * pgalloc.algorithm=<name>.
+ */
+class BuddyFIFOPageAllocator : public BuddyAllocator<MAX_ORDER, FREE_LIST_FIFO>
+{
+public:
+	const char* name() const override { return "buddy-fifo"; }
+};
+
+class BuddyOrderedPageAllocator : public BuddyAllocator<MAX_ORDER, FREE_LIST_ADDRESS_ORDERED>
+{
+public:
+	const char* name() const override { return "buddy-ordered"; }
+};
+
+class BuddySmallPageAllocator : public BuddyAllocator<10, FREE_LIST_LIFO>
+{
+public:
+	const char* name() const override { return "buddy-order10"; }
+};
+
+RegisterPageAllocator(BuddyFIFOPageAllocator);
+RegisterPageAllocator(BuddyOrderedPageAllocator);
+RegisterPageAllocator(BuddySmallPageAllocator);
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 /*
@@ -0,0 +1,129 @@
+/*
+ * The Buddy Page Allocator
+ *
+ * What the buddy allocator offers the rest of the kernel, beyond the page allocator interface.
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+
+using infos::mm::PageDescriptor;
+using infos::mm::pfn_t;
+
+/* The size of a page, as a power of two. */
+#define PAGE_SHIFT	12
+
+/**
+ * How long the contents of an allocation live, and whether they can be moved.
+ */
+enum PageMobility
+{
+	MOBILITY_UNMOVABLE,	// kernel data that stays put
+	MOBILITY_RECLAIMABLE,	// caches that can be dropped when memory is short
+	MOBILITY_MOVABLE,	// user pages, which can be migrated
+	NR_MOBILITY_TYPES,
+
+	// Pageblocks being compacted; nothing is ever allocated from them.
+	MOBILITY_ISOLATE = NR_MOBILITY_TYPES,
+	NR_FREE_LIST_TYPES
+};
+
+/**
+ * Moves an allocated block to a new home.  The migrator copies the contents across and repoints
+ * whatever maps the old block at the new one, keeping the owner from writing to the block in
+ * between, so that nothing written to it is lost.  It is called with no allocator locks held, so
+ * it may allocate.  If the owner frees the old block while it is being moved, the free is held
+ * back until the migrator returns, and the migrator should then report that it did not move it.
+ * @param from The block being moved.
+ * @param to The block it is moving to.
+ * @param order The order of both blocks.
+ * @return Returns TRUE if the block was moved, or FALSE if it is not one the migrator can move.
+ */
+typedef bool (*PageMigrator)(PageDescriptor *from, PageDescriptor *to, int order);
+
+/**
+ * Asks a subsystem holding memory it can give up (cached pages, object caches) to free some.
+ * @param nr_pages The number of pages the allocator would like back.
+ * @return Returns the number of pages actually freed.
+ */
+typedef uint64_t (*PageShrinker)(uint64_t nr_pages);
+
+/**
+ * Registers a shrinker with the buddy allocator for as long as the kernel runs, so that it is
+ * asked for memory from the moment the allocator is initialised.
+ */
+struct PageShrinkerRegistration
+{
+	PageShrinkerRegistration(PageShrinker shrinker);
+};
+
+#define RegisterPageShrinker(_fn) \
+	static PageShrinkerRegistration __pgshrinker_registration_##_fn(_fn)
+
+/**
+ * What every variant of the buddy allocator offers on top of the generic page allocator
+ * interface.  The entry points are documented in full in buddy.cpp.
+ */
+class BuddyAllocatorAlgorithm : public infos::mm::PageAllocatorAlgorithm
+{
+public:
+	using PageAllocatorAlgorithm::allocate_pages;
+	using PageAllocatorAlgorithm::free_pages;
+
+	/** Allocates 2^order pages, grouped with other allocations of the same mobility type. */
+	virtual PageDescriptor *allocate_pages(int order, PageMobility mobility) = 0;
+
+	/** Allocates 2^order pages from the given node, falling back on the others. */
+	virtual PageDescriptor *allocate_pages_node(int order, unsigned int node, PageMobility mobility = MOBILITY_UNMOVABLE) = 0;
+
+	/** Allocates 2^order pages as close as possible to the given page. */
+	virtual PageDescriptor *allocate_pages_near(pfn_t pfn, int order, PageMobility mobility = MOBILITY_UNMOVABLE) = 0;
+
+	/** Allocates up to count blocks of the same order, returning how many were allocated. */
+	virtual unsigned int allocate_pages_bulk(int order, unsigned int count, PageDescriptor **pages, PageMobility mobility = MOBILITY_UNMOVABLE) = 0;
+
+	/** Frees count blocks of the same order. */
+	virtual void free_pages_bulk(int order, unsigned int count, PageDescriptor **pages) = 0;
+
+	/** Frees a block, going by the order it was allocated with. */
+	virtual void free_pages(PageDescriptor *pgd) = 0;
+
+	/** Allocates any number of contiguous pages, which can only be freed with free_contiguous(). */
+	virtual PageDescriptor *allocate_contiguous(uint64_t count, PageMobility mobility = MOBILITY_UNMOVABLE) = 0;
+
+	/** Frees a run of pages from allocate_contiguous(). */
+	virtual void free_contiguous(PageDescriptor *pgd, uint64_t count) = 0;
+
+	/** Allocates a 2 MiB page from the pool reserved with pgalloc.hugepages. */
+	virtual PageDescriptor *allocate_huge_page() = 0;
+
+	/** Returns a huge page to the pool. */
+	virtual void free_huge_page(PageDescriptor *pgd) = 0;
+
+	/** Allocates 2^order zero-filled pages for user memory, from the zeroed pools if possible. */
+	virtual PageDescriptor *allocate_zeroed_pages(int order) = 0;
+
+	/** Tops up the zeroed pools now, as the zeroing daemon would in the background. */
+	virtual unsigned int fill_zero_pools() = 0;
+
+	/** Sets the order in which allocations preferring a node fall back on the other nodes. */
+	virtual bool set_node_fallbacks(unsigned int node, const unsigned int *nodes, unsigned int count) = 0;
+
+	/** Registers a shrinker after boot, for this allocator only. */
+	virtual bool register_shrinker(PageShrinker shrinker) = 0;
+
+	/** Registers the migrator compaction uses to move allocated blocks. */
+	virtual void register_page_migrator(PageMigrator migrator) = 0;
+
+	/** Returns the number of pages on the buddy lists. */
+	virtual uint64_t nr_free_pages() const = 0;
+
+	/** Returns the number of free pages held back in the per-CPU cache and the pools. */
+	virtual uint64_t nr_cached_pages() const = 0;
+};
+
+/**
+ * Returns the buddy allocator the kernel is running on.
+ * @return Returns the allocator, or NULL if pgalloc.algorithm picked something else.
+ */
+extern BuddyAllocatorAlgorithm *buddy_allocator();
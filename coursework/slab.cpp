@@ -0,0 +1,455 @@
+/*
+ * Slab Object Caches
+ *
+ * Caches of fixed-size kernel objects, carved out of slabs of pages from the page allocator.
+ */
+
+#include "slab.h"
+#include "buddy.h"
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+using namespace infos::util;
+
+#define PAGE_SIZE	(1 << PAGE_SHIFT)
+
+/*
+ * Every slab is a naturally aligned block of this order, so the slab an object lives in (and
+ * from there its cache) can be found by masking the object's address.
+ */
+#define SLAB_ORDER	2
+#define SLAB_SIZE	(PAGE_SIZE << SLAB_ORDER)
+
+#define CACHE_LINE_SIZE	64
+
+/* The number of objects a magazine holds, which makes a magazine exactly two cache lines. */
+#define MAGAZINE_SIZE	14
+
+/*
+ * The most full magazines a cache's depot holds.  Past this, full magazines are emptied back
+ * into their slabs, so that a burst of frees cannot pin an unbounded number of slabs.
+ */
+#define MAX_FULL_MAGAZINES	16
+
+/**
+ * The header at the front of every slab.
+ */
+struct Slab
+{
+	Slab *prev;
+	Slab *next;
+	ObjectCache *cache;
+	PageDescriptor *pgd;
+	void *free_objects;			// Chained through the first word of each free object.
+	unsigned int nr_in_use;
+};
+
+/**
+ * A small stack of free objects, which sits in front of the slabs.
+ */
+struct Magazine
+{
+	Magazine *next;
+	uint64_t rounds;
+	void *objects[MAGAZINE_SIZE];
+};
+
+static ObjectCache magazine_cache("magazine", sizeof(Magazine), CACHE_LINE_SIZE, false);
+
+static ObjectCache size_caches[] = {
+	ObjectCache("size-16", 16),
+	ObjectCache("size-32", 32),
+	ObjectCache("size-64", 64),
+	ObjectCache("size-128", 128),
+	ObjectCache("size-256", 256),
+	ObjectCache("size-512", 512),
+	ObjectCache("size-1024", 1024),
+	ObjectCache("size-2048", 2048),
+};
+
+#define NR_SIZE_CACHES	(sizeof(size_caches) / sizeof(size_caches[0]))
+
+static inline uint64_t align_up(uint64_t value, uint64_t align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+static inline Slab *slab_of(void *object)
+{
+	return (Slab *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static void slab_list_push(Slab **head, Slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head) (*head)->prev = slab;
+	*head = slab;
+}
+
+static void slab_list_remove(Slab **head, Slab *slab)
+{
+	if (slab->prev) slab->prev->next = slab->next;
+	else *head = slab->next;
+
+	if (slab->next) slab->next->prev = slab->prev;
+}
+
+ObjectCache::ObjectCache(const char *name, uint64_t object_size, uint64_t align, bool use_magazines)
+	: _name(name),
+	_next_colour(0),
+	_use_magazines(use_magazines),
+	_partial_slabs(NULL),
+	_full_slabs(NULL),
+	_empty_slabs(NULL),
+	_nr_slabs(0),
+	_nr_empty_slabs(0),
+	_loaded(NULL),
+	_previous(NULL),
+	_full_magazines(NULL),
+	_empty_magazines(NULL),
+	_nr_full_magazines(0)
+{
+	// A free object holds the link to the next one, so it must be at least a pointer wide.
+	if (object_size < sizeof(void *)) object_size = sizeof(void *);
+
+	_object_size = align_up(object_size, align);
+	_first_object = align_up(sizeof(Slab), align);
+
+	if (_first_object + _object_size > SLAB_SIZE) {
+		_objects_per_slab = 0;
+		_max_colour = 0;
+	} else {
+		_objects_per_slab = (SLAB_SIZE - _first_object) / _object_size;
+
+		// Whatever is left over at the end of a slab is used to stagger where its objects start.
+		_max_colour = SLAB_SIZE - _first_object - _objects_per_slab * _object_size;
+	}
+
+	_colour_step = align_up(CACHE_LINE_SIZE, align);
+}
+
+ObjectCache *ObjectCache::cache_of(void *object)
+{
+	return slab_of(object)->cache;
+}
+
+/**
+ * Allocates a new slab from the page allocator, and puts it on the empty list.
+ * @return Returns the slab, or NULL if there is no memory.
+ */
+Slab *ObjectCache::grow()
+{
+	PageDescriptor *pgd = sys.mm().pgalloc().alloc_pages(SLAB_ORDER);
+	if (!pgd) return NULL;
+
+	Slab *slab = (Slab *)sys.mm().pgalloc().pgd_to_vpa(pgd);
+	slab->cache = this;
+	slab->pgd = pgd;
+	slab->free_objects = NULL;
+	slab->nr_in_use = 0;
+
+	// Chain the objects up backwards, so that they are handed out in address order.
+	uint8_t *first = (uint8_t *)slab + _first_object + _next_colour;
+	for (unsigned int i = _objects_per_slab; i > 0; i--) {
+		void **object = (void **)(first + (i - 1) * _object_size);
+		*object = slab->free_objects;
+		slab->free_objects = object;
+	}
+
+	_next_colour += _colour_step;
+	if (_next_colour > _max_colour) _next_colour = 0;
+
+	slab_list_push(&_empty_slabs, slab);
+	_nr_empty_slabs++;
+	_nr_slabs++;
+
+	return slab;
+}
+
+/**
+ * Returns a slab, which must not be on any list, to the page allocator.
+ * @param slab The slab.
+ */
+void ObjectCache::destroy_slab(Slab *slab)
+{
+	sys.mm().pgalloc().free_pages(slab->pgd, SLAB_ORDER);
+	_nr_slabs--;
+}
+
+/**
+ * Takes an object from the fullest slab to hand, growing the cache if every slab is full.
+ * @return Returns the object, or NULL if there is no memory.
+ */
+void *ObjectCache::take_from_slab()
+{
+	Slab *slab = _partial_slabs;
+	if (!slab) {
+		slab = _empty_slabs;
+		if (!slab) {
+			slab = grow();
+			if (!slab) return NULL;
+		}
+
+		slab_list_remove(&_empty_slabs, slab);
+		_nr_empty_slabs--;
+		slab_list_push(&_partial_slabs, slab);
+	}
+
+	void **object = (void **)slab->free_objects;
+	slab->free_objects = *object;
+	slab->nr_in_use++;
+
+	if (slab->nr_in_use == _objects_per_slab) {
+		slab_list_remove(&_partial_slabs, slab);
+		slab_list_push(&_full_slabs, slab);
+	}
+
+	return object;
+}
+
+/**
+ * Puts an object back on its slab's free list.
+ * @param object The object.
+ */
+void ObjectCache::return_to_slab(void *object)
+{
+	Slab *slab = slab_of(object);
+
+	if (slab->nr_in_use == _objects_per_slab) {
+		slab_list_remove(&_full_slabs, slab);
+		slab_list_push(&_partial_slabs, slab);
+	}
+
+	*(void **)object = slab->free_objects;
+	slab->free_objects = object;
+	slab->nr_in_use--;
+
+	if (slab->nr_in_use == 0) {
+		slab_list_remove(&_partial_slabs, slab);
+
+		// Keep one empty slab back, so that a cache sitting on a slab boundary does not keep
+		// going back to the page allocator.
+		if (_nr_empty_slabs > 0) {
+			destroy_slab(slab);
+		} else {
+			slab_list_push(&_empty_slabs, slab);
+			_nr_empty_slabs++;
+		}
+	}
+}
+
+void *ObjectCache::allocate()
+{
+	if (!_objects_per_slab) return NULL;
+
+	UniqueIRQLock l;
+
+	if (_use_magazines) {
+		if (_loaded && _loaded->rounds > 0) {
+			return _loaded->objects[--_loaded->rounds];
+		}
+
+		if (_previous && _previous->rounds > 0) {
+			Magazine *magazine = _previous;
+			_previous = _loaded;
+			_loaded = magazine;
+
+			return _loaded->objects[--_loaded->rounds];
+		}
+
+		// Both magazines are empty, so trade one of them in for a full one from the depot.
+		if (_full_magazines) {
+			if (_previous) {
+				_previous->next = _empty_magazines;
+				_empty_magazines = _previous;
+			}
+
+			_previous = _loaded;
+			_loaded = _full_magazines;
+			_full_magazines = _loaded->next;
+			_nr_full_magazines--;
+
+			return _loaded->objects[--_loaded->rounds];
+		}
+	}
+
+	return take_from_slab();
+}
+
+void ObjectCache::free(void *object)
+{
+	if (!object) return;
+
+	UniqueIRQLock l;
+
+	if (_use_magazines) {
+		if (_loaded && _loaded->rounds < MAGAZINE_SIZE) {
+			_loaded->objects[_loaded->rounds++] = object;
+			return;
+		}
+
+		if (_previous && _previous->rounds < MAGAZINE_SIZE) {
+			Magazine *magazine = _previous;
+			_previous = _loaded;
+			_loaded = magazine;
+
+			_loaded->objects[_loaded->rounds++] = object;
+			return;
+		}
+
+		// Both magazines are full.  If the depot is too, the older one is emptied back into
+		// the slabs and loaded again.
+		if (_previous && _nr_full_magazines >= MAX_FULL_MAGAZINES) {
+			Magazine *magazine = _previous;
+			for (uint64_t i = 0; i < magazine->rounds; i++) {
+				return_to_slab(magazine->objects[i]);
+			}
+
+			magazine->rounds = 0;
+			_previous = _loaded;
+			_loaded = magazine;
+
+			_loaded->objects[_loaded->rounds++] = object;
+			return;
+		}
+
+		// Otherwise, trade one of them in for an empty one.  If there is no memory for a new
+		// magazine, the object goes straight back to its slab.
+		Magazine *magazine = _empty_magazines;
+		if (magazine) {
+			_empty_magazines = magazine->next;
+		} else {
+			magazine = (Magazine *)magazine_cache.allocate();
+			if (magazine) magazine->rounds = 0;
+		}
+
+		if (magazine) {
+			if (_previous) {
+				_previous->next = _full_magazines;
+				_full_magazines = _previous;
+				_nr_full_magazines++;
+			}
+
+			_previous = _loaded;
+			_loaded = magazine;
+
+			_loaded->objects[_loaded->rounds++] = object;
+			return;
+		}
+	}
+
+	return_to_slab(object);
+}
+
+uint64_t ObjectCache::reap()
+{
+	UniqueIRQLock l;
+
+	uint64_t nr_slabs = _nr_slabs;
+
+	// Send the loaded magazines to the depot too, so that nothing is left pinning a slab.
+	Magazine *magazines[] = { _loaded, _previous };
+	for (Magazine *magazine : magazines) {
+		if (magazine) {
+			magazine->next = _full_magazines;
+			_full_magazines = magazine;
+		}
+	}
+	_loaded = NULL;
+	_previous = NULL;
+
+	while (_full_magazines) {
+		Magazine *magazine = _full_magazines;
+		_full_magazines = magazine->next;
+
+		for (uint64_t i = 0; i < magazine->rounds; i++) {
+			return_to_slab(magazine->objects[i]);
+		}
+
+		magazine_cache.free(magazine);
+	}
+	_nr_full_magazines = 0;
+
+	while (_empty_magazines) {
+		Magazine *magazine = _empty_magazines;
+		_empty_magazines = magazine->next;
+
+		magazine_cache.free(magazine);
+	}
+
+	while (_empty_slabs) {
+		Slab *slab = _empty_slabs;
+		slab_list_remove(&_empty_slabs, slab);
+		destroy_slab(slab);
+	}
+	_nr_empty_slabs = 0;
+
+	return (nr_slabs - _nr_slabs) << SLAB_ORDER;
+}
+
+void ObjectCache::dump_state() const
+{
+	UniqueIRQLock l;
+
+	uint64_t nr_in_magazines = 0;
+	if (_loaded) nr_in_magazines += _loaded->rounds;
+	if (_previous) nr_in_magazines += _previous->rounds;
+	nr_in_magazines += _nr_full_magazines * MAGAZINE_SIZE;
+
+	mm_log.messagef(LogLevel::DEBUG, "slab: %s: %lu-byte objects, %u per slab from %lu, colour 0-%lu",
+			_name, _object_size, _objects_per_slab, _first_object, _max_colour);
+	mm_log.messagef(LogLevel::DEBUG, "slab: %s: %lu slabs (%lu empty), %lu objects in magazines",
+			_name, _nr_slabs, _nr_empty_slabs, nr_in_magazines);
+}
+
+void *slab_alloc(uint64_t size)
+{
+	for (unsigned int i = 0; i < NR_SIZE_CACHES; i++) {
+		if (size <= size_caches[i].object_size()) {
+			return size_caches[i].allocate();
+		}
+	}
+
+	return NULL;
+}
+
+void slab_free(void *object)
+{
+	if (!object) return;
+
+	ObjectCache::cache_of(object)->free(object);
+}
+
+uint64_t slab_shrink(uint64_t nr_pages)
+{
+	uint64_t nr_freed = 0;
+
+	// Reap one cache at a time, stopping as soon as the page allocator has what it asked for.
+	// Each reap leaves magazines behind in the magazine cache, which gives them back at once.
+	for (unsigned int i = 0; i < NR_SIZE_CACHES && nr_freed < nr_pages; i++) {
+		nr_freed += size_caches[i].reap();
+		nr_freed += magazine_cache.reap();
+	}
+
+	return nr_freed;
+}
+
+/* The object caches can always give back the slabs their magazines and free lists pin. */
+RegisterPageShrinker(slab_shrink);
+
+uint64_t slab_reap()
+{
+	uint64_t nr_pages = 0;
+
+	for (unsigned int i = 0; i < NR_SIZE_CACHES; i++) {
+		nr_pages += size_caches[i].reap();
+	}
+
+	// The magazines the other caches just gave up are only returned to the page allocator here.
+	return nr_pages + magazine_cache.reap();
+}
@@ -0,0 +1,115 @@
+/*
+ * Slab Object Caches
+ *
+ * Caches of fixed-size kernel objects, carved out of slabs of pages from the page allocator.
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+
+struct Slab;
+struct Magazine;
+
+/**
+ * A cache of fixed-size objects.  Allocations and frees go through a pair of magazines (small
+ * stacks of objects) first, so the common case touches no slab at all.  Behind the magazines,
+ * objects are carved out of slabs: naturally aligned blocks of SLAB_ORDER pages, each with a
+ * small header at the front and its objects offset by a rotating colour, so that the same
+ * object in different slabs does not always land on the same cache lines.
+ */
+class ObjectCache
+{
+public:
+	/**
+	 * Sets up the cache's geometry.  Nothing is allocated until the first object is.
+	 * @param name The name of the cache, for debugging.
+	 * @param object_size The size of the objects in the cache.
+	 * @param align The alignment of the objects, which must be a power of two.
+	 * @param use_magazines Whether allocations and frees go through magazines.  Only the cache
+	 * the magazines themselves come from goes without.
+	 */
+	ObjectCache(const char *name, uint64_t object_size, uint64_t align = 8, bool use_magazines = true);
+
+	/**
+	 * Allocates an object.
+	 * @return Returns the object, or NULL if the page allocator has run out of memory.
+	 */
+	void *allocate();
+
+	/**
+	 * Frees an object back to the cache.
+	 * @param object The object, which must have come from this cache.
+	 */
+	void free(void *object);
+
+	/**
+	 * Hands everything the cache is holding on to, but not using, back to the page allocator:
+	 * the objects in every magazine, the magazines themselves, and every empty slab.
+	 * @return Returns the number of pages given back.
+	 */
+	uint64_t reap();
+
+	/** Dumps the cache's geometry and usage to the log. */
+	void dump_state() const;
+
+	const char *name() const { return _name; }
+	uint64_t object_size() const { return _object_size; }
+
+	/** Returns the cache an object was allocated from. */
+	static ObjectCache *cache_of(void *object);
+
+private:
+	Slab *grow();
+	void destroy_slab(Slab *slab);
+	void *take_from_slab();
+	void return_to_slab(void *object);
+
+	const char *_name;
+	uint64_t _object_size;
+	unsigned int _objects_per_slab;
+	uint64_t _first_object;
+	uint64_t _colour_step;
+	uint64_t _max_colour;
+	uint64_t _next_colour;
+	bool _use_magazines;
+
+	Slab *_partial_slabs;
+	Slab *_full_slabs;
+	Slab *_empty_slabs;
+	uint64_t _nr_slabs;
+	uint64_t _nr_empty_slabs;
+
+	// There is one CPU, so one pair of magazines in front of the depot.
+	Magazine *_loaded;
+	Magazine *_previous;
+	Magazine *_full_magazines;
+	Magazine *_empty_magazines;
+	uint64_t _nr_full_magazines;
+};
+
+/**
+ * Allocates an object of the given size from the smallest general-purpose cache that fits it.
+ * @param size The size of the object, which must be no more than 2048 bytes.
+ * @return Returns the object, or NULL if it is too big or memory has run out.
+ */
+extern void *slab_alloc(uint64_t size);
+
+/**
+ * Frees an object from slab_alloc().
+ * @param object The object.
+ */
+extern void slab_free(void *object);
+
+/**
+ * Reaps every general-purpose cache, and the magazine cache.
+ * @return Returns the number of pages given back to the page allocator.
+ */
+extern uint64_t slab_reap();
+
+/**
+ * The PageShrinker the object caches register with the buddy allocator, which reaps caches one
+ * at a time until it has given back as many pages as were asked for.
+ * @param nr_pages The number of pages the page allocator would like back.
+ * @return Returns the number of pages given back.
+ */
+extern uint64_t slab_shrink(uint64_t nr_pages);
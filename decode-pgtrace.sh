@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Decodes the "pgtrace" lines the buddy allocator writes to debugcon when booted with
+# pgalloc.debug=1, into per-order latency and churn statistics, and the call sites that
+# cause the most splitting.
+#
+#   ./run.sh pgalloc.algorithm=buddy pgalloc.debug=1 | tee boot.log
+#   ./decode-pgtrace.sh boot.log
+#
+
+awk '
+match($0, /pgtrace .*/) {
+	split(substr($0, RSTART), f, " ")
+	type = f[3]; order = f[5] + 0; cycles = f[6] + 0; caller = f[7]
+
+	events[type, order]++
+	if (type == "alloc" && f[4] == "ffffffff") failed[order]++
+	if (type == "alloc" || type == "free") {
+		total[type, order] += cycles
+		if (cycles > worst[type, order]) worst[type, order] = cycles
+	}
+	if (type == "split") splits_by_caller[caller]++
+	if (order > max_order) max_order = order
+	seen++
+}
+
+function avg(type, order) {
+	return events[type, order] ? total[type, order] / events[type, order] : 0
+}
+
+END {
+	if (!seen) {
+		print "no pgtrace events found" > "/dev/stderr"
+		exit 1
+	}
+
+	printf "%5s %8s %6s %10s %10s %8s %10s %10s %8s %8s\n", "order", "allocs", "failed", "avg-cyc", "max-cyc", "frees", "avg-cyc", "max-cyc", "splits", "merges"
+	for (o = 0; o <= max_order; o++) {
+		printf "%5d %8d %6d %10d %10d %8d %10d %10d %8d %8d\n", o,
+			events["alloc", o], failed[o], avg("alloc", o), worst["alloc", o],
+			events["free", o], avg("free", o), worst["free", o],
+			events["split", o], events["merge", o]
+	}
+
+	print ""
+	print "callers causing the most splits:"
+	for (c in splits_by_caller) printf "%10d  %s\n", splits_by_caller[c], c | "sort -rn | head -10"
+}
+' "$@"
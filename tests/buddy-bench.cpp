@@ -0,0 +1,553 @@
+/*
+ * Buddy Allocator Benchmarks
+ *
+ * Throughput benchmarks for the buddy allocator, run on the host against the kernel stand-ins.
+ * Usage: buddy-bench [benchmark...] [pgalloc.<argument>=<value>...]
+ * With no benchmark names, every benchmark runs.  pgalloc.algorithm picks the variant to run.
+ */
+
+#include "harness.h"
+#include "../coursework/buddy.cpp"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <type_traits>
+
+/* How many times each measurement is repeated; the best run is reported. */
+#define BENCH_REPEATS	5
+
+/** Boots the variant picked with pgalloc.algorithm. */
+static PageAllocatorAlgorithm *boot(uint64_t nr_pages, uint64_t nr_usable)
+{
+	PageAllocatorAlgorithm *allocator = harness::boot(harness::algorithm(), nr_pages, nr_usable);
+	if (!allocator) {
+		fprintf(stderr, "bench: no allocator called '%s'\n", harness::algorithm());
+		exit(2);
+	}
+
+	return allocator;
+}
+
+/**
+ * Calls fn with a null pointer to the variant picked with pgalloc.algorithm, so that benchmarks
+ * needing more than the generic allocator interface can be instantiated for the right type.
+ */
+template<typename Fn>
+static void with_variant(Fn fn)
+{
+	const char *name = harness::algorithm();
+	if (strcmp(name, "buddy-fifo") == 0) {
+		fn((BuddyFIFOPageAllocator *)NULL);
+	} else if (strcmp(name, "buddy-ordered") == 0) {
+		fn((BuddyOrderedPageAllocator *)NULL);
+	} else if (strcmp(name, "buddy-order10") == 0) {
+		fn((BuddySmallPageAllocator *)NULL);
+	} else {
+		fn((BuddyPageAllocator *)NULL);
+	}
+}
+
+/** Prints one result line. */
+static void report(const char *name, uint64_t nr_ops, uint64_t ns)
+{
+	printf("%-32s %10lu ops %10.1f ns/op %12.0f ops/s\n", name, nr_ops, (double)ns / nr_ops, nr_ops * 1e9 / ns);
+}
+
+/*
+ * Allocate-and-free pairs of each order, against a background of live allocations so that the
+ * free lists are not trivially empty, then filling all of memory with blocks of each order and
+ * freeing it all again.
+ */
+static void bench_orders()
+{
+	const uint64_t nr_pages = 1 << 18;
+	const uint64_t nr_pairs = 1 << 18;
+
+	for (int order = 0; order <= 10; order++) {
+		uint64_t best = ~0ul;
+
+		for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+			PageAllocatorAlgorithm *allocator = boot(nr_pages, nr_pages);
+
+			std::mt19937_64 rng(order);
+			std::vector<PageDescriptor *> background;
+			for (int i = 0; i < 1024; i++) {
+				background.push_back(allocator->allocate_pages(rng() % 4));
+			}
+
+			uint64_t start = harness::now_ns();
+			for (uint64_t i = 0; i < nr_pairs; i++) {
+				PageDescriptor *pgd = allocator->allocate_pages(order);
+				allocator->free_pages(pgd, order);
+			}
+
+			best = std::min(best, harness::now_ns() - start);
+		}
+
+		char name[48];
+		snprintf(name, sizeof(name), "alloc+free/order:%d", order);
+		report(name, nr_pairs, best);
+	}
+
+	for (int order = 0; order <= 10; order += 2) {
+		uint64_t best_fill = ~0ul, best_drain = ~0ul;
+		uint64_t nr_blocks = nr_pages >> order;
+
+		std::vector<PageDescriptor *> blocks(nr_blocks);
+
+		for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+			PageAllocatorAlgorithm *allocator = boot(nr_pages, nr_pages);
+
+			uint64_t start = harness::now_ns();
+			for (uint64_t i = 0; i < nr_blocks; i++) {
+				blocks[i] = allocator->allocate_pages(order);
+			}
+
+			uint64_t middle = harness::now_ns();
+
+			// Freeing in a shuffled order makes the merges land all over memory.
+			std::shuffle(blocks.begin(), blocks.end(), std::mt19937_64(order));
+
+			uint64_t drain_start = harness::now_ns();
+			for (uint64_t i = 0; i < nr_blocks; i++) {
+				allocator->free_pages(blocks[i], order);
+			}
+
+			best_fill = std::min(best_fill, middle - start);
+			best_drain = std::min(best_drain, harness::now_ns() - drain_start);
+		}
+
+		char name[48];
+		snprintf(name, sizeof(name), "fill/order:%d", order);
+		report(name, nr_blocks, best_fill);
+		snprintf(name, sizeof(name), "drain/order:%d", order);
+		report(name, nr_blocks, best_drain);
+	}
+}
+
+/**
+ * The free path buddy.cpp started from, for comparison: singly-linked free lists, with a block's
+ * buddy found by walking the list of its order.
+ */
+struct ListBuddy
+{
+	static const pfn_t none = ~0ul;
+
+	std::vector<pfn_t> next;
+	pfn_t heads[MAX_ORDER + 1];
+
+	ListBuddy(uint64_t nr_pages) : next(nr_pages, none)
+	{
+		std::fill(heads, heads + MAX_ORDER + 1, none);
+	}
+
+	void free(pfn_t pfn, int order)
+	{
+		for (; order < MAX_ORDER; order++) {
+			pfn_t buddy = pfn ^ (1ul << order);
+
+			pfn_t *slot = &heads[order];
+			while (*slot != none && *slot != buddy) slot = &next[*slot];
+			if (*slot == none) break;
+
+			*slot = next[buddy];
+			pfn &= ~(1ul << order);
+		}
+
+		next[pfn] = heads[order];
+		heads[order] = pfn;
+	}
+};
+
+/*
+ * Freeing into fragmented memory: every odd page is freed first, which leaves half a free page
+ * in every pair and nothing to merge, then the even pages are freed in a shuffled order, each one
+ * coalescing as far as it can.  The list walk the allocator started from is run the same way, as
+ * the baseline for the current free path, which checks each buddy with one read of its recorded
+ * order in free_info.
+ */
+static void bench_fragmented_free()
+{
+	for (int memory_order = 10; memory_order <= 14; memory_order += 2) {
+		const uint64_t nr_pages = 1ul << memory_order;
+		uint64_t best_order_check = ~0ul, best_list = ~0ul;
+
+		std::vector<pfn_t> evens;
+		for (pfn_t pfn = 0; pfn < nr_pages; pfn += 2) evens.push_back(pfn);
+		std::shuffle(evens.begin(), evens.end(), std::mt19937_64(memory_order));
+
+		for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+			PageAllocatorAlgorithm *allocator = boot(nr_pages, nr_pages);
+
+			std::vector<PageDescriptor *> pages(nr_pages);
+			for (uint64_t i = 0; i < nr_pages; i++) {
+				PageDescriptor *pgd = allocator->allocate_pages(0);
+				pages[harness::pgd_to_pfn(pgd)] = pgd;
+			}
+
+			for (pfn_t pfn = 1; pfn < nr_pages; pfn += 2) allocator->free_pages(pages[pfn], 0);
+
+			uint64_t start = harness::now_ns();
+			for (pfn_t pfn : evens) allocator->free_pages(pages[pfn], 0);
+			best_order_check = std::min(best_order_check, harness::now_ns() - start);
+
+			ListBuddy list(nr_pages);
+			for (pfn_t pfn = 1; pfn < nr_pages; pfn += 2) list.free(pfn, 0);
+
+			start = harness::now_ns();
+			for (pfn_t pfn : evens) list.free(pfn, 0);
+			best_list = std::min(best_list, harness::now_ns() - start);
+		}
+
+		char name[48];
+		snprintf(name, sizeof(name), "fragmented-free/order-check:%lu", nr_pages);
+		report(name, evens.size(), best_order_check);
+		snprintf(name, sizeof(name), "fragmented-free/list:%lu", nr_pages);
+		report(name, evens.size(), best_list);
+	}
+}
+
+/* Boot-time setup: init() for 1.5M page descriptors (6 GiB), then inserting all of it. */
+static void bench_boot()
+{
+	const uint64_t nr_pages = 1536 * 1024;
+	uint64_t best_init = ~0ul, best_insert = ~0ul;
+
+	for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+		uint64_t start = harness::now_ns();
+		PageAllocatorAlgorithm *allocator = boot(nr_pages, 0);
+		uint64_t middle = harness::now_ns();
+
+		allocator->insert_page_range(harness::pfn_to_pgd(0), nr_pages);
+
+		best_init = std::min(best_init, middle - start);
+		best_insert = std::min(best_insert, harness::now_ns() - middle);
+	}
+
+	printf("%-32s %10.3f ms\n", "boot/init:1.5M", best_init / 1e6);
+	printf("%-32s %10.3f ms\n", "boot/insert:1.5M", best_insert / 1e6);
+}
+
+/** Returns the order of the largest free block, or -1 if nothing is free. */
+static int largest_free_order(uint64_t nr_pages)
+{
+	int largest = -1;
+	for (pfn_t pfn = 0; pfn < nr_pages; pfn++) {
+		int order = free_info[pfn].order;
+		if (order != NOT_FREE && order > largest) largest = order;
+	}
+
+	return largest;
+}
+
+/*
+ * Long-running fragmentation: a mix of short-lived user pages and long-lived kernel pages, with
+ * the order of the largest free block (and the number of free pageblocks) sampled as it goes.
+ * Run it with pgalloc.pcp=1 as well, to see the per-CPU cache keep out of the way.
+ */
+template<typename Allocator>
+static void fragment()
+{
+	const uint64_t nr_pages = 1 << 18;
+	const uint64_t nr_ops = 1 << 22;
+	const uint64_t nr_samples = 8;
+
+	Allocator *allocator = static_cast<Allocator *>(boot(nr_pages, nr_pages));
+
+	std::mt19937_64 rng(1);
+	std::vector<PageDescriptor *> user, kernel;
+
+	uint64_t start = harness::now_ns();
+
+	for (uint64_t i = 1; i <= nr_ops; i++) {
+		// Keep memory about three quarters full, with one page in eight held by the kernel.
+		bool full = user.size() + kernel.size() >= nr_pages * 3 / 4;
+		unsigned int choice = rng() % 16;
+
+		if (!full && choice < 7) {
+			if (PageDescriptor *pgd = allocator->allocate_pages(0, MOBILITY_MOVABLE)) user.push_back(pgd);
+		} else if (!full && choice < 8) {
+			if (PageDescriptor *pgd = allocator->allocate_pages(0)) kernel.push_back(pgd);
+		} else {
+			std::vector<PageDescriptor *>& pages = choice % 8 ? user : kernel;
+			if (pages.empty()) continue;
+
+			size_t index = rng() % pages.size();
+			allocator->free_pages(pages[index], 0);
+			pages[index] = pages.back();
+			pages.pop_back();
+		}
+
+		if (i % (nr_ops / nr_samples) == 0) {
+			uint64_t ns = harness::now_ns() - start;
+
+			uint64_t nr_free_pageblocks = 0;
+			for (pfn_t pfn = 0; pfn < nr_pages; pfn += 1 << PAGEBLOCK_ORDER) {
+				if (free_info[pfn].order != NOT_FREE && free_info[pfn].order >= PAGEBLOCK_ORDER) nr_free_pageblocks++;
+			}
+
+			char name[48];
+			snprintf(name, sizeof(name), "fragmentation/ops:%luk", i >> 10);
+			printf("%-32s largest free order %2d, %4lu free pageblocks, %10.0f ops/s\n", name,
+				largest_free_order(nr_pages), nr_free_pageblocks, i * 1e9 / ns);
+		}
+	}
+
+	for (PageDescriptor *pgd : user) allocator->free_pages(pgd, 0);
+	for (PageDescriptor *pgd : kernel) allocator->free_pages(pgd, 0);
+}
+
+static void bench_fragmentation()
+{
+	with_variant([](auto *variant) {
+		fragment<std::remove_pointer_t<decltype(variant)>>();
+	});
+}
+
+/*
+ * Node-local allocation across four emulated nodes (pgalloc.nodes=4), with order-0 and order-2
+ * allocations made on behalf of each node in turn.  With the demand balanced, every node should
+ * be served locally; with one node asking for half again what it has, the overflow spills onto the
+ * others in fallback order.  The share of allocations that landed on the node they asked for is
+ * reported alongside the throughput.
+ */
+template<typename Allocator>
+static void numa(const char *scenario, bool skewed)
+{
+	const unsigned int nr_nodes = 4;
+	const int node_order = 16;
+	const uint64_t nr_pages = (uint64_t)nr_nodes << node_order;
+	const uint64_t nr_ops = 1 << 22;
+
+	harness::set_argument("pgalloc.nodes", "4");
+	Allocator *allocator = static_cast<Allocator *>(boot(nr_pages, nr_pages));
+
+	// Each node keeps up to this many pages' worth of blocks live: half its memory, or half as
+	// much again as it has when skewed.
+	uint64_t demand[nr_nodes];
+	for (unsigned int node = 0; node < nr_nodes; node++) {
+		demand[node] = (skewed && node == 0 ? 3 : 1) * (1ul << node_order) / 2;
+	}
+
+	std::mt19937_64 rng(1);
+	std::vector<std::pair<PageDescriptor *, int>> live[nr_nodes];
+	uint64_t nr_live[nr_nodes] = { };
+	uint64_t nr_local = 0, nr_allocs = 0;
+
+	uint64_t start = harness::now_ns();
+
+	for (uint64_t i = 0; i < nr_ops; i++) {
+		unsigned int node = i % nr_nodes;
+
+		if (nr_live[node] < demand[node] && (live[node].empty() || rng() % 4)) {
+			int order = rng() % 4 ? 0 : 2;
+
+			PageDescriptor *pgd = allocator->allocate_pages_node(order, node);
+			if (!pgd) continue;
+
+			nr_allocs++;
+			if ((harness::pgd_to_pfn(pgd) >> node_order) == node) nr_local++;
+
+			live[node].push_back({ pgd, order });
+			nr_live[node] += 1ul << order;
+		} else {
+			size_t index = rng() % live[node].size();
+			auto block = live[node][index];
+			live[node][index] = live[node].back();
+			live[node].pop_back();
+
+			allocator->free_pages(block.first, block.second);
+			nr_live[node] -= 1ul << block.second;
+		}
+	}
+
+	uint64_t ns = harness::now_ns() - start;
+
+	char name[48];
+	snprintf(name, sizeof(name), "numa/%s", scenario);
+	printf("%-32s %10lu allocs %6.2f%% local %12.0f ops/s\n", name, nr_allocs, 100.0 * nr_local / nr_allocs, nr_ops * 1e9 / ns);
+
+	for (unsigned int node = 0; node < nr_nodes; node++) {
+		for (auto& block : live[node]) allocator->free_pages(block.first, block.second);
+	}
+}
+
+static void bench_numa()
+{
+	with_variant([](auto *variant) {
+		numa<std::remove_pointer_t<decltype(variant)>>("balanced", false);
+		numa<std::remove_pointer_t<decltype(variant)>>("skewed", true);
+	});
+
+	harness::set_argument("pgalloc.nodes", "1");
+}
+
+/*
+ * Page-table locality: a process's page tables and user pages are allocated into fragmented
+ * memory, either with allocate_pages_near() (each table next to its parent, each user page next
+ * to the one before) or without any hint.  The mean distance from each page to the page it was
+ * hinted at, and the number of 2 MiB regions the process ends up spread over, are reported with
+ * the time to walk it: every user page is reached through its root and table, the way a page
+ * walk would, so the run time follows how many distinct cache sets and TLB entries it needs.
+ */
+template<typename Allocator>
+static void locality(bool hinted)
+{
+	const uint64_t nr_pages = 1 << 18;
+	const unsigned int nr_tables = 64;
+	const unsigned int pages_per_table = 256;
+	const unsigned int nr_walks = 64;
+
+	Allocator *allocator = static_cast<Allocator *>(boot(nr_pages, nr_pages));
+
+	// Fragment memory by freeing a random half of it.
+	std::vector<PageDescriptor *> background;
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) background.push_back(pgd);
+
+	std::mt19937_64 rng(1);
+	std::shuffle(background.begin(), background.end(), rng);
+	for (size_t i = 0; i < background.size() / 2; i++) allocator->free_pages(background[i], 0);
+
+	// Every page is written to as it is allocated, so that the walk touches real memory rather
+	// than the host's shared zero page.
+	auto allocate = [&](PageDescriptor *near) {
+		PageDescriptor *pgd = hinted ? allocator->allocate_pages_near(harness::pgd_to_pfn(near), 0) : allocator->allocate_pages(0);
+		*(uint64_t *)harness::pgd_to_vpa(pgd) = 1;
+		return pgd;
+	};
+
+	PageDescriptor *root = allocate(background.back());
+	PageDescriptor *tables[nr_tables];
+	std::vector<PageDescriptor *> pages;
+
+	uint64_t total_distance = 0;
+	std::vector<bool> regions(nr_pages >> PAGEBLOCK_ORDER);
+
+	for (unsigned int table = 0; table < nr_tables; table++) {
+		tables[table] = allocate(root);
+
+		PageDescriptor *previous = tables[table];
+		for (unsigned int i = 0; i < pages_per_table; i++) {
+			PageDescriptor *pgd = allocate(previous);
+
+			pfn_t pfn = harness::pgd_to_pfn(pgd), near = harness::pgd_to_pfn(previous);
+			total_distance += pfn > near ? pfn - near : near - pfn;
+			regions[pfn >> PAGEBLOCK_ORDER] = true;
+
+			pages.push_back(pgd);
+			previous = pgd;
+		}
+	}
+
+	uint64_t nr_regions = std::count(regions.begin(), regions.end(), true);
+
+	uint64_t start = harness::now_ns();
+
+	for (unsigned int walk = 0; walk < nr_walks; walk++) {
+		for (size_t i = 0; i < pages.size(); i++) {
+			(void)*(volatile uint64_t *)harness::pgd_to_vpa(root);
+			(void)*(volatile uint64_t *)harness::pgd_to_vpa(tables[i / pages_per_table]);
+			(void)*(volatile uint64_t *)harness::pgd_to_vpa(pages[i]);
+		}
+	}
+
+	uint64_t ns = harness::now_ns() - start;
+
+	char name[48];
+	snprintf(name, sizeof(name), "locality/%s", hinted ? "hinted" : "unhinted");
+	printf("%-32s %10.1f pages apart %6lu regions %10.1f ns/walk\n", name, (double)total_distance / pages.size(),
+		nr_regions, (double)ns / (nr_walks * pages.size()));
+}
+
+static void bench_locality()
+{
+	with_variant([](auto *variant) {
+		locality<std::remove_pointer_t<decltype(variant)>>(false);
+		locality<std::remove_pointer_t<decltype(variant)>>(true);
+	});
+}
+
+/*
+ * Page-fault latency: each fault takes a zeroed page for user memory and writes to it, as the
+ * fault handler does.  With the zeroed pools left empty every page is zeroed inline; with them
+ * topped up between faults, the way the zeroing daemon would in idle time, the pages come ready.
+ * All of memory is written once beforehand, so that the host's own page faults stay out of it.
+ * The median and 99th percentile time per fault are reported.
+ */
+static void page_faults(bool pooled)
+{
+	const uint64_t nr_pages = 1 << 16;
+	const uint64_t nr_faults = 1 << 14;
+
+	BuddyAllocatorAlgorithm *allocator = static_cast<BuddyAllocatorAlgorithm *>(boot(nr_pages, nr_pages));
+
+	std::vector<PageDescriptor *> pages;
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) {
+		memset(harness::pgd_to_vpa(pgd), 0xa5, 1 << PAGE_SHIFT);
+		pages.push_back(pgd);
+	}
+
+	for (PageDescriptor *pgd : pages) allocator->free_pages(pgd, 0);
+	pages.clear();
+
+	std::vector<uint64_t> latencies(nr_faults);
+
+	for (uint64_t i = 0; i < nr_faults; i++) {
+		if (pooled && i % ZERO_POOL_PAGES == 0) allocator->fill_zero_pools();
+
+		uint64_t start = harness::now_ns();
+		PageDescriptor *pgd = allocator->allocate_zeroed_pages(0);
+		*(volatile uint64_t *)harness::pgd_to_vpa(pgd) = i;
+		latencies[i] = harness::now_ns() - start;
+
+		pages.push_back(pgd);
+	}
+
+	for (PageDescriptor *pgd : pages) allocator->free_pages(pgd);
+
+	std::sort(latencies.begin(), latencies.end());
+
+	char name[48];
+	snprintf(name, sizeof(name), "page-fault/%s", pooled ? "pooled" : "inline");
+	printf("%-32s %10lu faults %8lu ns median %8lu ns p99\n", name, nr_faults, latencies[nr_faults / 2],
+		latencies[nr_faults * 99 / 100]);
+}
+
+static void bench_page_faults()
+{
+	page_faults(false);
+	page_faults(true);
+}
+
+static const struct
+{
+	const char *name;
+	void (*fn)();
+} benchmarks[] = {
+	{ "orders", bench_orders },
+	{ "fragmented-free", bench_fragmented_free },
+	{ "boot", bench_boot },
+	{ "fragmentation", bench_fragmentation },
+	{ "numa", bench_numa },
+	{ "locality", bench_locality },
+	{ "page-fault", bench_page_faults },
+};
+
+int main(int argc, char **argv)
+{
+	argc = harness::parse_arguments(argc - 1, argv + 1);
+
+	printf("algorithm: %s\n", harness::algorithm());
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(benchmarks); i++) {
+		bool selected = argc == 0;
+		for (int arg = 0; arg < argc; arg++) {
+			if (strcmp(argv[arg + 1], benchmarks[i].name) == 0) selected = true;
+		}
+
+		if (selected) benchmarks[i].fn();
+	}
+
+	return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * Buddy Allocator Differential Fuzzer
+ *
+ * Drives the buddy allocator with a seeded random mix of single, bulk, near, contiguous, huge
+ * and zeroed allocations, the matching frees, insert_page_range and remove_page_range, and checks
+ * it against a reference model that keeps one state per page.  Pages the allocator holds back in
+ * the per-CPU cache or its pools are free as far as the model is concerned.  After every
+ * operation, the allocator's free and cached page counts must add up to the model's free count,
+ * and every block it hands out must be aligned and entirely free in the model.  Every few
+ * operations, the free blocks themselves are checked: they must only cover pages the model has
+ * free, the free pages they leave out must be exactly the ones held back, and no free block may
+ * have a free buddy of the same order.
+ *
+ * Run it with pgalloc.pcp=1 and pgalloc.hugepages=<n> too, to cover the cache and the pool.
+ *
+ * Usage: buddy-fuzz [seed [nr_ops [nr_pages [check_interval]]]] [pgalloc.<argument>=<value>...]
+ */
+
+#include "harness.h"
+#include "../coursework/buddy.cpp"
+
+#include <stdarg.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+enum ModelPageState : uint8_t
+{
+	PAGE_ABSENT,		// not inserted, or removed again
+	PAGE_FREE,
+	PAGE_ALLOCATED,
+};
+
+/* How an allocation was made, which decides how it has to be freed. */
+enum AllocationKind : uint8_t
+{
+	ALLOCATION_BLOCK,	// a 2^order block, from any of the block entry points
+	ALLOCATION_RUN,		// a run from allocate_contiguous()
+	ALLOCATION_HUGE,	// a page from the huge page pool
+};
+
+struct Allocation
+{
+	pfn_t pfn;
+	uint64_t count;
+	int order;
+	AllocationKind kind;
+};
+
+/**
+ * The reference model: the state of every page, and the allocations made from it.
+ */
+struct Model
+{
+	std::vector<uint8_t> pages;
+	std::vector<Allocation> allocated;
+	uint64_t nr_free;
+
+	void set(pfn_t start, uint64_t count, ModelPageState state)
+	{
+		for (pfn_t pfn = start; pfn < start + count; pfn++) {
+			if (pages[pfn] == PAGE_FREE) nr_free--;
+			pages[pfn] = state;
+			if (state == PAGE_FREE) nr_free++;
+		}
+	}
+
+	bool all(pfn_t start, uint64_t count, ModelPageState state) const
+	{
+		for (pfn_t pfn = start; pfn < start + count; pfn++) {
+			if (pages[pfn] != state) return false;
+		}
+
+		return true;
+	}
+
+	/** Returns TRUE if a free page is sitting in the huge page pool. */
+	bool in_huge_pool(pfn_t pfn) const
+	{
+		pfn_t head = pfn & ~((1ul << HUGE_PAGE_ORDER) - 1);
+		return pages[pfn] == PAGE_FREE && free_info[head].alloc_order == HUGE_PAGE;
+	}
+
+	/**
+	 * Returns TRUE if a block of the given order could be allocated from the free pages.  Pages
+	 * in the huge page pool are free, but never handed out as anything but huge pages.
+	 */
+	bool has_free_block(int order) const
+	{
+		uint64_t size = 1ul << order;
+		uint64_t step = std::min(size, 1ul << HUGE_PAGE_ORDER);
+
+		for (pfn_t pfn = 0; pfn + size <= pages.size(); pfn += size) {
+			if (!all(pfn, size, PAGE_FREE)) continue;
+
+			bool pooled = false;
+			for (pfn_t page = pfn; page < pfn + size; page += step) {
+				if (in_huge_pool(page)) pooled = true;
+			}
+
+			if (!pooled) return true;
+		}
+
+		return false;
+	}
+
+	/** Checks that a new allocation is free and aligned, and takes it out of the free pages. */
+	void allocate(PageDescriptor *pgd, uint64_t count, int order, AllocationKind kind);
+};
+
+static uint64_t seed;
+static uint64_t op;
+
+static void fuzz_fail(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+static void fuzz_fail(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+
+	printf("seed %lu, op %lu: ", seed, op);
+	vprintf(fmt, args);
+	printf("\n");
+
+	va_end(args);
+	exit(1);
+}
+
+void Model::allocate(PageDescriptor *pgd, uint64_t count, int order, AllocationKind kind)
+{
+	pfn_t pfn = harness::pgd_to_pfn(pgd);
+	uint64_t size = 1ul << order;
+
+	if ((pfn & (size - 1)) || pfn + count > pages.size()) fuzz_fail("bad allocation %lx+%lx order %d", pfn, count, order);
+	if (!all(pfn, count, PAGE_FREE)) fuzz_fail("allocation %lx+%lx overlaps pages that are not free", pfn, count);
+
+	set(pfn, count, PAGE_ALLOCATED);
+	allocated.push_back({ pfn, count, order, kind });
+}
+
+/**
+ * Checks the allocator's free blocks against the model, through the free block table every
+ * variant of the allocator shares.  Only the entries of pages the allocator manages mean
+ * anything.  Free pages outside any free block must be the ones the allocator holds back.
+ */
+template<int max_order>
+static void check_free_blocks(const Model& model, uint64_t nr_pfns, uint64_t nr_cached)
+{
+	uint64_t nr_held_back = 0;
+
+	pfn_t pfn = 0;
+	while (pfn < nr_pfns) {
+		int order = free_info[pfn].order;
+		if (order == NOT_FREE) {
+			if (model.pages[pfn] == PAGE_FREE) nr_held_back++;
+
+			pfn++;
+			continue;
+		}
+
+		uint64_t size = 1ul << order;
+		if (order > max_order || (pfn & (size - 1)) || pfn + size > nr_pfns) {
+			fuzz_fail("bad free block %lx order %d", pfn, order);
+		}
+
+		if (!model.all(pfn, size, PAGE_FREE)) fuzz_fail("free block %lx order %d covers pages that are not free", pfn, order);
+
+		pfn_t buddy = pfn ^ size;
+		if (order < max_order && buddy < nr_pfns && free_info[buddy].order == order) {
+			fuzz_fail("free block %lx order %d was not coalesced with its buddy", pfn, order);
+		}
+
+		pfn += size;
+	}
+
+	if (nr_held_back != nr_cached) {
+		fuzz_fail("%lu free pages are not in free blocks, allocator holds back %lu", nr_held_back, nr_cached);
+	}
+}
+
+/** Returns TRUE if the allocator has a free block of the given order or above on its lists. */
+static bool has_listed_block(int order, uint64_t nr_pfns)
+{
+	for (pfn_t pfn = 0; pfn < nr_pfns; pfn++) {
+		if (free_info[pfn].order != NOT_FREE && free_info[pfn].order >= order) return true;
+	}
+
+	return false;
+}
+
+/** Scribbles on a block before it is freed, so that zeroed allocations have something to clear. */
+static void scribble(pfn_t pfn, uint64_t count)
+{
+	for (uint64_t i = 0; i < count; i++) {
+		*(uint64_t *)harness::pgd_to_vpa(harness::pfn_to_pgd(pfn + i)) = 0xa5a5a5a5a5a5a5a5ul;
+	}
+}
+
+template<typename Allocator, int max_order>
+static void fuzz(uint64_t nr_ops, uint64_t nr_pages, uint64_t check_interval)
+{
+	std::mt19937_64 rng(seed);
+
+	// Start with part of memory present, and leave the rest to be hot-added.
+	uint64_t nr_booted = nr_pages / 2;
+	Allocator *allocator = static_cast<Allocator *>(harness::boot(harness::algorithm(), nr_booted, 0));
+	if (!allocator) {
+		printf("no allocator called '%s'\n", harness::algorithm());
+		exit(2);
+	}
+
+	Model model;
+	model.pages.assign(nr_pages, PAGE_ABSENT);
+	model.nr_free = 0;
+
+	// Inserting pages past the end grows the range the allocator manages.
+	uint64_t nr_managed = nr_booted;
+
+	enum { OP_ALLOC, OP_BULK, OP_NEAR, OP_CONTIGUOUS, OP_HUGE, OP_ZEROED, OP_FREE, OP_INSERT, OP_REMOVE, NR_OPS };
+	static const char *op_names[NR_OPS] = { "allocs", "bulk", "near", "contiguous", "huge", "zeroed", "frees", "inserts", "removes" };
+	uint64_t counts[NR_OPS] = { };
+
+	for (op = 0; op < nr_ops; op++) {
+		unsigned int choice = rng() % 100;
+
+		if (choice < 35) {
+			int order = rng() % 8 ? rng() % 4 : rng() % (MAX_ORDER + 2);
+
+			PageDescriptor *pgd = allocator->allocate_pages(order);
+			if (!pgd) {
+				if (order <= max_order && model.has_free_block(order)) fuzz_fail("order %d allocation failed with a block free", order);
+				continue;
+			}
+
+			if (order > max_order) fuzz_fail("order %d allocation succeeded", order);
+
+			model.allocate(pgd, 1ul << order, order, ALLOCATION_BLOCK);
+			counts[OP_ALLOC]++;
+		} else if (choice < 38) {
+			// Bulk allocations only carve up what is on the lists, and never drain the caches.
+			int order = rng() % 4;
+			unsigned int count = 1 + rng() % 16;
+
+			PageDescriptor *pgds[16];
+			unsigned int nr_allocated = allocator->allocate_pages_bulk(order, count, pgds);
+			if (nr_allocated > count) fuzz_fail("bulk allocation of %u returned %u", count, nr_allocated);
+
+			for (unsigned int i = 0; i < nr_allocated; i++) {
+				model.allocate(pgds[i], 1ul << order, order, ALLOCATION_BLOCK);
+			}
+
+			if (nr_allocated < count && has_listed_block(order, nr_managed)) {
+				fuzz_fail("bulk allocation of %u order %d stopped at %u with a block listed", count, order, nr_allocated);
+			}
+
+			counts[OP_BULK]++;
+		} else if (choice < 42) {
+			int order = rng() % 4;
+			pfn_t near = rng() % nr_managed;
+			PageMobility mobility = (PageMobility)(rng() % NR_MOBILITY_TYPES);
+
+			PageDescriptor *pgd = allocator->allocate_pages_near(near, order, mobility);
+			if (!pgd) {
+				if (model.has_free_block(order)) fuzz_fail("order %d allocation near %lx failed with a block free", order, near);
+				continue;
+			}
+
+			model.allocate(pgd, 1ul << order, order, ALLOCATION_BLOCK);
+			counts[OP_NEAR]++;
+		} else if (choice < 45) {
+			uint64_t count = 1 + rng() % (rng() % 4 ? 16 : 300);
+			int order = 0;
+			while ((1ul << order) < count) order++;
+
+			PageDescriptor *pgd = allocator->allocate_contiguous(count);
+			if (!pgd) {
+				if (order <= max_order && model.has_free_block(order)) fuzz_fail("run of %lu failed with a block free", count);
+				continue;
+			}
+
+			model.allocate(pgd, count, order, ALLOCATION_RUN);
+			counts[OP_CONTIGUOUS]++;
+		} else if (choice < 47) {
+			PageDescriptor *pgd = allocator->allocate_huge_page();
+			if (!pgd) continue;
+
+			if (!model.in_huge_pool(harness::pgd_to_pfn(pgd))) fuzz_fail("huge page %lx is not from the pool", harness::pgd_to_pfn(pgd));
+
+			model.allocate(pgd, 1ul << HUGE_PAGE_ORDER, HUGE_PAGE_ORDER, ALLOCATION_HUGE);
+			counts[OP_HUGE]++;
+		} else if (choice < 50) {
+			// The zeroing daemon never runs on the host, so the pools are filled by hand now and
+			// then, and are otherwise empty.
+			if (rng() % 16 == 0) allocator->fill_zero_pools();
+
+			int order = rng() % 6;
+
+			PageDescriptor *pgd = allocator->allocate_zeroed_pages(order);
+			if (!pgd) {
+				if (model.has_free_block(order)) fuzz_fail("order %d zeroed allocation failed with a block free", order);
+				continue;
+			}
+
+			for (uint64_t i = 0; i < (1ul << order); i++) {
+				if (*(uint64_t *)harness::pgd_to_vpa(pgd + i) != 0) fuzz_fail("zeroed block %lx was not zeroed", harness::pgd_to_pfn(pgd));
+			}
+
+			model.allocate(pgd, 1ul << order, order, ALLOCATION_BLOCK);
+			counts[OP_ZEROED]++;
+		} else if (choice < 85) {
+			if (model.allocated.empty()) continue;
+
+			size_t index = rng() % model.allocated.size();
+			Allocation allocation = model.allocated[index];
+			model.allocated[index] = model.allocated.back();
+			model.allocated.pop_back();
+
+			scribble(allocation.pfn, allocation.count);
+
+			PageDescriptor *pgd = harness::pfn_to_pgd(allocation.pfn);
+			switch (allocation.kind) {
+			case ALLOCATION_BLOCK:
+				// Blocks can be freed with their order, by the order recorded for them, or in a
+				// batch of one.
+				switch (rng() % 3) {
+				case 0: allocator->free_pages(pgd, allocation.order); break;
+				case 1: allocator->free_pages(pgd); break;
+				case 2: allocator->free_pages_bulk(allocation.order, 1, &pgd); break;
+				}
+				break;
+
+			case ALLOCATION_RUN:
+				allocator->free_contiguous(pgd, allocation.count);
+				break;
+
+			case ALLOCATION_HUGE:
+				allocator->free_huge_page(pgd);
+				break;
+			}
+
+			model.set(allocation.pfn, allocation.count, PAGE_FREE);
+			counts[OP_FREE]++;
+		} else if (choice < 95) {
+			// Insert a run of absent pages, which may lie beyond what has been managed so far.
+			pfn_t start = rng() % nr_pages;
+			if (model.pages[start] != PAGE_ABSENT) continue;
+
+			uint64_t max_count = 1 + rng() % (rng() % 4 ? 64 : nr_pages / 4);
+			uint64_t count = 0;
+			while (count < max_count && start + count < nr_pages && model.pages[start + count] == PAGE_ABSENT) count++;
+
+			allocator->insert_page_range(harness::pfn_to_pgd(start), count);
+			model.set(start, count, PAGE_FREE);
+			if (start + count > nr_managed) nr_managed = start + count;
+			counts[OP_INSERT]++;
+		} else {
+			// Removing a range takes its free pages away, and leaves allocated ones be.
+			pfn_t start = rng() % nr_pages;
+			uint64_t count = 1 + rng() % (rng() % 4 ? 64 : 1024);
+			if (start + count > nr_pages) count = nr_pages - start;
+
+			allocator->remove_page_range(harness::pfn_to_pgd(start), count);
+			for (pfn_t pfn = start; pfn < start + count; pfn++) {
+				if (model.pages[pfn] == PAGE_FREE) model.set(pfn, 1, PAGE_ABSENT);
+			}
+
+			counts[OP_REMOVE]++;
+		}
+
+		if (allocator->nr_free_pages() + allocator->nr_cached_pages() != model.nr_free) {
+			fuzz_fail("allocator has %lu pages free and %lu held back, model has %lu free", allocator->nr_free_pages(),
+				allocator->nr_cached_pages(), model.nr_free);
+		}
+
+		if (harness::take_errors()) fuzz_fail("allocator logged an error");
+
+		if (op % check_interval == 0) {
+			check_free_blocks<max_order>(model, nr_managed, allocator->nr_cached_pages());
+		}
+	}
+
+	check_free_blocks<max_order>(model, nr_managed, allocator->nr_cached_pages());
+
+	printf("%s seed %lu:", harness::algorithm(), seed);
+	for (unsigned int i = 0; i < NR_OPS; i++) {
+		printf(" %lu %s,", counts[i], op_names[i]);
+	}
+	printf(" %lu pages free\n", model.nr_free);
+}
+
+int main(int argc, char **argv)
+{
+	argc = harness::parse_arguments(argc - 1, argv + 1);
+
+	seed = argc > 0 ? strtoull(argv[1], NULL, 0) : 1;
+	uint64_t nr_ops = argc > 1 ? strtoull(argv[2], NULL, 0) : 1000000;
+	uint64_t nr_pages = argc > 2 ? strtoull(argv[3], NULL, 0) : 1 << 13;
+	uint64_t check_interval = argc > 3 ? strtoull(argv[4], NULL, 0) : 16;
+
+	if (!nr_pages || nr_pages > HARNESS_MAX_PAGES || !check_interval) {
+		printf("bad arguments\n");
+		return 2;
+	}
+
+	const char *name = harness::algorithm();
+	if (strcmp(name, "buddy") == 0) {
+		fuzz<BuddyPageAllocator, MAX_ORDER>(nr_ops, nr_pages, check_interval);
+	} else if (strcmp(name, "buddy-fifo") == 0) {
+		fuzz<BuddyFIFOPageAllocator, MAX_ORDER>(nr_ops, nr_pages, check_interval);
+	} else if (strcmp(name, "buddy-ordered") == 0) {
+		fuzz<BuddyOrderedPageAllocator, MAX_ORDER>(nr_ops, nr_pages, check_interval);
+	} else if (strcmp(name, "buddy-order10") == 0) {
+		fuzz<BuddySmallPageAllocator, 10>(nr_ops, nr_pages, check_interval);
+	} else {
+		printf("no allocator called '%s'\n", name);
+		return 2;
+	}
+
+	return 0;
+}
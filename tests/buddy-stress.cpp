@@ -0,0 +1,130 @@
+/*
+ * Buddy Allocator Concurrency Stress Test
+ *
+ * Hammers the allocator from several host threads at once, to exercise the per-order locking.
+ * Every page handed out is claimed in a shared ownership table with an atomic compare-and-swap,
+ * so a block handed to two threads at once is caught the moment it happens.  At the end, every
+ * block must have coalesced back.  The total throughput for each thread count is reported too,
+ * but it says nothing about scaling unless the host has at least that many CPUs.  Build it with
+ * "make tsan" to run it under ThreadSanitizer.
+ *
+ * Usage: buddy-stress [nr_ops_per_thread [max_threads]] [pgalloc.<argument>=<value>...]
+ *
+ * The per-CPU page cache is only protected by disabling interrupts, which does nothing on the
+ * host, so it must stay off (as it is by default).
+ */
+
+#include "harness.h"
+#include "../coursework/buddy.cpp"
+
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+
+static const int memory_order = 16;
+static const uint64_t nr_pages = 1ul << memory_order;
+
+/* The thread that owns each page, or zero. */
+static std::atomic<uint32_t> owners[nr_pages];
+
+static std::atomic<bool> failed;
+
+static void claim(PageDescriptor *pgd, int order, uint32_t owner)
+{
+	pfn_t start = harness::pgd_to_pfn(pgd);
+
+	for (pfn_t pfn = start; pfn < start + (1ul << order); pfn++) {
+		uint32_t expected = 0;
+		if (!owners[pfn].compare_exchange_strong(expected, owner)) {
+			printf("thread %u: page %lx of order %d block %lx already belongs to thread %u\n", owner, pfn, order, start, expected);
+			failed = true;
+		}
+	}
+}
+
+static void release(PageDescriptor *pgd, int order)
+{
+	pfn_t start = harness::pgd_to_pfn(pgd);
+
+	for (pfn_t pfn = start; pfn < start + (1ul << order); pfn++) {
+		owners[pfn].store(0, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Allocates and frees blocks of mixed orders and mobility types, keeping up to a few hundred
+ * allocated at once so that blocks are split and merged across threads.
+ */
+static void churn(BuddyPageAllocator *allocator, uint32_t owner, uint64_t nr_ops)
+{
+	std::mt19937_64 rng(owner);
+	std::vector<std::pair<PageDescriptor *, int>> live;
+
+	for (uint64_t i = 0; i < nr_ops && !failed; i++) {
+		if (live.empty() || (live.size() < 256 && rng() % 2)) {
+			int order = rng() % 8 ? rng() % 2 : rng() % 6;
+
+			PageDescriptor *pgd = rng() % 4 ? allocator->allocate_pages(order) : allocator->allocate_pages(order, (PageMobility)(rng() % NR_MOBILITY_TYPES));
+			if (!pgd) continue;
+
+			claim(pgd, order, owner);
+			live.push_back({ pgd, order });
+		} else {
+			size_t index = rng() % live.size();
+			auto block = live[index];
+			live[index] = live.back();
+			live.pop_back();
+
+			release(block.first, block.second);
+			allocator->free_pages(block.first, block.second);
+		}
+	}
+
+	for (auto& block : live) {
+		release(block.first, block.second);
+		allocator->free_pages(block.first, block.second);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	argc = harness::parse_arguments(argc - 1, argv + 1);
+
+	uint64_t nr_ops = argc > 0 ? strtoull(argv[1], NULL, 0) : 200000;
+	unsigned int max_threads = argc > 1 ? strtoul(argv[2], NULL, 0) : 8;
+
+	for (unsigned int nr_threads = 1; nr_threads <= max_threads && !failed; nr_threads *= 2) {
+		BuddyPageAllocator *allocator = static_cast<BuddyPageAllocator *>(harness::boot("buddy", nr_pages, nr_pages));
+
+		uint64_t start = harness::now_ns();
+
+		std::vector<std::thread> threads;
+		for (unsigned int i = 0; i < nr_threads; i++) {
+			threads.emplace_back(churn, allocator, i + 1, nr_ops);
+		}
+
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		uint64_t ns = harness::now_ns() - start;
+
+		if (allocator->nr_free_pages() != nr_pages) {
+			printf("%u threads: %lu of %lu pages free at the end\n", nr_threads, allocator->nr_free_pages(), nr_pages);
+			failed = true;
+		}
+
+		// Everything has to have coalesced back into one block.
+		if (!allocator->allocate_pages(memory_order)) {
+			printf("%u threads: memory did not coalesce back into one block\n", nr_threads);
+			failed = true;
+		}
+
+		if (harness::take_errors()) failed = true;
+
+		printf("%2u threads: %10.0f ops/s\n", nr_threads, nr_threads * nr_ops * 1e9 / ns);
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,1258 @@
+/*
+ * Buddy Allocator Tests
+ *
+ * Correctness tests for the buddy allocator, run on the host against the kernel stand-ins.
+ * Most of them run with pgalloc.check=1, so the allocator checks its own free lists after every
+ * operation and any inconsistency shows up as a logged error.
+ */
+
+#include "harness.h"
+#include "../coursework/buddy.cpp"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+
+/** Boots the allocator under test, with the first nr_usable of nr_pages pages available. */
+template<typename Allocator = BuddyPageAllocator>
+static Allocator *boot(const char *name, uint64_t nr_pages, uint64_t nr_usable)
+{
+	PageAllocatorAlgorithm *allocator = harness::boot(name, nr_pages, nr_usable);
+	CHECK(allocator != NULL);
+
+	return static_cast<Allocator *>(allocator);
+}
+
+static BuddyPageAllocator *boot(uint64_t nr_pages, uint64_t nr_usable)
+{
+	return boot<BuddyPageAllocator>("buddy", nr_pages, nr_usable);
+}
+
+/** Returns the page-frame-number of a block. */
+static pfn_t pfn_of(PageDescriptor *pgd)
+{
+	return harness::pgd_to_pfn(pgd);
+}
+
+/**
+ * Returns the number of blocks of the given order that can be allocated, freeing them all again
+ * afterwards.  Everything having coalesced back is the same as this being nr_free >> order.
+ */
+template<typename Allocator>
+static uint64_t nr_allocatable(Allocator *allocator, int order)
+{
+	std::vector<PageDescriptor *> blocks;
+	while (PageDescriptor *pgd = allocator->allocate_pages(order)) {
+		blocks.push_back(pgd);
+	}
+
+	for (PageDescriptor *pgd : blocks) {
+		allocator->free_pages(pgd, order);
+	}
+
+	return blocks.size();
+}
+
+TEST(every_order_is_aligned)
+{
+	const uint64_t nr_pages = 1 << 20;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	std::vector<uint8_t> used(nr_pages);
+	std::vector<std::pair<PageDescriptor *, int>> blocks;
+
+	for (int order = 0; order <= MAX_ORDER; order++) {
+		PageDescriptor *pgd = allocator->allocate_pages(order);
+		CHECK(pgd != NULL);
+		CHECK((pfn_of(pgd) & ((1ul << order) - 1)) == 0);
+
+		for (pfn_t pfn = pfn_of(pgd); pfn < pfn_of(pgd) + (1ul << order); pfn++) {
+			CHECK(!used[pfn]);
+			used[pfn] = 1;
+		}
+
+		blocks.push_back({ pgd, order });
+	}
+
+	CHECK(allocator->allocate_pages(MAX_ORDER + 1) == NULL);
+	CHECK(allocator->allocate_pages(-1) == NULL);
+
+	for (auto& block : blocks) {
+		allocator->free_pages(block.first, block.second);
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, MAX_ORDER) == nr_pages >> MAX_ORDER);
+}
+
+TEST(frees_coalesce_in_any_order)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	std::vector<PageDescriptor *> pages;
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) {
+		pages.push_back(pgd);
+	}
+
+	CHECK(pages.size() == nr_pages);
+	CHECK(allocator->nr_free_pages() == 0);
+
+	std::mt19937_64 rng(1);
+	std::shuffle(pages.begin(), pages.end(), rng);
+
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 12) == 1);
+}
+
+TEST(ranges_are_inserted_and_removed)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 14;
+	BuddyPageAllocator *allocator = boot(nr_pages, 0);
+
+	// Unaligned ranges, with holes between them.
+	allocator->insert_page_range(harness::pfn_to_pgd(3), 157);
+	allocator->insert_page_range(harness::pfn_to_pgd(256), nr_pages - 256 - 100);
+	allocator->remove_page_range(harness::pfn_to_pgd(1000), 37);
+
+	uint64_t expected = 157 + (nr_pages - 356) - 37;
+	CHECK(allocator->nr_free_pages() == expected);
+
+	std::vector<PageDescriptor *> pages;
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) {
+		pfn_t pfn = pfn_of(pgd);
+		CHECK(pfn >= 3 && pfn < nr_pages - 100);
+		CHECK(pfn >= 256 || pfn < 160);
+		CHECK(pfn < 1000 || pfn >= 1037);
+
+		pages.push_back(pgd);
+	}
+
+	CHECK(pages.size() == expected);
+
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	// Putting the holes back lets everything coalesce into one block.
+	allocator->insert_page_range(harness::pfn_to_pgd(0), 3);
+	allocator->insert_page_range(harness::pfn_to_pgd(160), 96);
+	allocator->insert_page_range(harness::pfn_to_pgd(1000), 37);
+	allocator->insert_page_range(harness::pfn_to_pgd(nr_pages - 100), 100);
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 14) == 1);
+}
+
+TEST(hot_added_memory_makes_whole_blocks)
+{
+	const uint64_t nr_pages = 1ul << MAX_ORDER;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// Hot-add 1 GiB past the end while another thread allocates and frees, which has to be
+	// able to carry on around it.
+	std::atomic<bool> stop(false);
+	std::thread churn([&] {
+		std::mt19937_64 rng(1);
+		std::vector<PageDescriptor *> live;
+
+		while (!stop || !live.empty()) {
+			if (!stop && (live.empty() || (live.size() < 256 && rng() % 2))) {
+				if (PageDescriptor *pgd = allocator->allocate_pages(0)) live.push_back(pgd);
+			} else {
+				allocator->free_pages(live.back(), 0);
+				live.pop_back();
+			}
+		}
+	});
+
+	allocator->insert_page_range(harness::pfn_to_pgd(nr_pages), nr_pages);
+
+	stop = true;
+	churn.join();
+
+	CHECK(allocator->nr_free_pages() == 2 * nr_pages);
+
+	// Both gigabytes come back as single top-order blocks.
+	PageDescriptor *first = allocator->allocate_pages(MAX_ORDER);
+	PageDescriptor *second = allocator->allocate_pages(MAX_ORDER);
+	CHECK(first && second);
+	CHECK(pfn_of(first) + pfn_of(second) == nr_pages);
+	CHECK(allocator->allocate_pages(0) == NULL);
+
+	allocator->free_pages(first, MAX_ORDER);
+	allocator->free_pages(second, MAX_ORDER);
+}
+
+TEST(bad_frees_are_reported)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	PageDescriptor *pgd = allocator->allocate_pages(2);
+	allocator->free_pages(pgd, 2);
+	CHECK(harness::take_errors() == 0);
+
+	// Freeing it again, or freeing a page in the middle of a block, is caught and ignored.
+	allocator->free_pages(pgd, 2);
+	CHECK(harness::take_errors() == 1);
+
+	pgd = allocator->allocate_pages(2);
+	allocator->free_pages(pgd + 1, 0);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_pages(pgd);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+}
+
+TEST(frees_go_by_the_recorded_order)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// A block freed with the wrong order is freed with the order it was allocated with.
+	PageDescriptor *pgd = allocator->allocate_pages(3);
+	allocator->free_pages(pgd, 0);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+
+	pgd = allocator->allocate_pages(5);
+	allocator->free_pages(pgd);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(harness::take_errors() == 0);
+}
+
+TEST(bulk_allocations_are_whole_blocks)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	PageDescriptor *blocks[300];
+	unsigned int nr_blocks = allocator->allocate_pages_bulk(2, 300, blocks);
+	CHECK(nr_blocks == 300);
+
+	std::vector<uint8_t> used(nr_pages);
+	for (unsigned int i = 0; i < nr_blocks; i++) {
+		CHECK((pfn_of(blocks[i]) & 3) == 0);
+		CHECK(!used[pfn_of(blocks[i])]);
+		used[pfn_of(blocks[i])] = 1;
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages - 4 * 300);
+
+	allocator->free_pages_bulk(2, nr_blocks, blocks);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 12) == 1);
+}
+
+TEST(bulk_frees_are_checked_like_single_frees)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// Blocks freed with the wrong order go by the order they were allocated with, and a block
+	// that was never allocated is reported and skipped.
+	PageDescriptor *blocks[17];
+	CHECK(allocator->allocate_pages_bulk(3, 16, blocks) == 16);
+	blocks[16] = blocks[15] + 1;
+
+	allocator->free_pages_bulk(MAX_ORDER + 5, 17, blocks);
+	CHECK(harness::take_errors() == 1);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 12) == 1);
+}
+
+TEST(contiguous_runs_give_back_the_tail)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	PageDescriptor *run = allocator->allocate_contiguous(37);
+	CHECK(run != NULL);
+	CHECK(allocator->nr_free_pages() == nr_pages - 37);
+
+	allocator->free_contiguous(run, 37);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 12) == 1);
+}
+
+TEST(contiguous_runs_are_only_freed_whole)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// A run is not a block, so freeing it by order, or with the wrong length, is turned away.
+	PageDescriptor *run = allocator->allocate_contiguous(5);
+	allocator->free_pages(run, 3);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_pages(run);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_contiguous(run, 8);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_contiguous(run + 1, 4);
+	CHECK(harness::take_errors() == 1);
+	CHECK(allocator->nr_free_pages() == nr_pages - 5);
+
+	// Nor can a block be freed as a run.
+	PageDescriptor *pgd = allocator->allocate_pages(2);
+	allocator->free_contiguous(pgd, 4);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_contiguous(run, 5);
+	allocator->free_pages(pgd, 2);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+
+	// A run of a whole block is still a run.
+	run = allocator->allocate_contiguous(8);
+	allocator->free_pages(run, 3);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_contiguous(run, 8);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+}
+
+TEST(entry_points_are_exported)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// Everything kernel code can reach through buddy.h, with nothing but the interface.
+	BuddyAllocatorAlgorithm *buddy = buddy_allocator();
+	CHECK(buddy == allocator);
+
+	PageDescriptor *blocks[4];
+	CHECK(buddy->allocate_pages_bulk(1, 4, blocks) == 4);
+	buddy->free_pages_bulk(1, 4, blocks);
+
+	PageDescriptor *run = buddy->allocate_contiguous(5, MOBILITY_MOVABLE);
+	CHECK(run != NULL);
+	buddy->free_contiguous(run, 5);
+
+	PageDescriptor *pgd = buddy->allocate_pages(0, MOBILITY_MOVABLE);
+	PageDescriptor *near = buddy->allocate_pages_near(pfn_of(pgd), 0);
+	CHECK(near != NULL);
+	buddy->free_pages(near);
+	buddy->free_pages(pgd);
+
+	CHECK(buddy->nr_free_pages() == nr_pages);
+
+	// Filling the zeroed pools takes their blocks off the buddy lists, and zeroed allocations
+	// are then served from them.
+	unsigned int nr_filled = buddy->fill_zero_pools();
+	CHECK(nr_filled > 0);
+	CHECK(buddy->fill_zero_pools() == 0);
+
+	uint64_t nr_free = buddy->nr_free_pages();
+	CHECK(nr_free < nr_pages);
+
+	pgd = buddy->allocate_zeroed_pages(0);
+	CHECK(pgd != NULL);
+	CHECK(buddy->nr_free_pages() == nr_free);
+	CHECK(*(uint64_t *)harness::pgd_to_vpa(pgd) == 0);
+	buddy->free_pages(pgd);
+}
+
+TEST(only_kernel_pages_go_through_the_cache)
+{
+	harness::set_argument("pgalloc.check", "1");
+	harness::set_argument("pgalloc.pcp", "1");
+
+	const uint64_t nr_pages = 1 << 14;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// Freed user pages go straight back to the buddy lists, so the kernel pages the cache hands
+	// out all come from kernel pageblocks.
+	std::vector<PageDescriptor *> pages;
+	for (int i = 0; i < PCP_HIGH; i++) {
+		pages.push_back(allocator->allocate_pages(0, MOBILITY_MOVABLE));
+	}
+
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	pages.clear();
+	for (int i = 0; i < PCP_HIGH; i++) {
+		PageDescriptor *pgd = allocator->allocate_pages(0);
+		CHECK(pageblock_mobilities[pfn_of(pgd) >> PAGEBLOCK_ORDER] == MOBILITY_UNMOVABLE);
+		pages.push_back(pgd);
+	}
+
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+}
+
+/*
+ * A shrinker over pages the test has marked as reclaimable, which frees them back through the
+ * allocator, and so into the per-CPU cache when it is enabled.
+ */
+static BuddyPageAllocator *shrink_allocator;
+static std::vector<PageDescriptor *> reclaimable_pages;
+
+static uint64_t shrink_reclaimable(uint64_t nr_pages)
+{
+	uint64_t nr_freed = 0;
+	while (nr_freed < nr_pages && !reclaimable_pages.empty()) {
+		shrink_allocator->free_pages(reclaimable_pages.back(), 0);
+		reclaimable_pages.pop_back();
+		nr_freed++;
+	}
+
+	return nr_freed;
+}
+
+TEST(cache_refills_survive_reclaim)
+{
+	harness::set_argument("pgalloc.check", "1");
+	harness::set_argument("pgalloc.pcp", "1");
+
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+	shrink_allocator = allocator;
+	allocator->register_shrinker(shrink_reclaimable);
+
+	// Every page handed out can be reclaimed, so allocation keeps going well past the size of
+	// memory, with reclaim freeing into the cache in the middle of refills, and refills coming
+	// up empty once reclaim has parked everything in the cache.
+	for (uint64_t i = 0; i < 4 * nr_pages; i++) {
+		PageDescriptor *pgd = allocator->allocate_pages(0);
+		CHECK(pgd != NULL);
+		reclaimable_pages.push_back(pgd);
+	}
+
+	// Nothing went missing along the way.
+	while (!reclaimable_pages.empty()) {
+		allocator->free_pages(reclaimable_pages.back(), 0);
+		reclaimable_pages.pop_back();
+	}
+
+	CHECK(nr_allocatable(allocator, 13) == 1);
+}
+
+TEST(huge_pages_only_go_back_to_the_pool)
+{
+	harness::set_argument("pgalloc.check", "1");
+	harness::set_argument("pgalloc.hugepages", "2");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+	CHECK(allocator->nr_free_pages() == nr_pages - 2 * 512);
+
+	// A pool page is not a buddy block, whatever order it is freed with.
+	PageDescriptor *huge = allocator->allocate_huge_page();
+	CHECK(huge != NULL);
+
+	allocator->free_pages(huge, HUGE_PAGE_ORDER);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_pages(huge);
+	CHECK(harness::take_errors() == 1);
+	CHECK(allocator->nr_free_pages() == nr_pages - 2 * 512);
+
+	// Nor is a buddy block of the same size a pool page.
+	PageDescriptor *block = allocator->allocate_pages(HUGE_PAGE_ORDER);
+	CHECK(block != NULL);
+
+	allocator->free_huge_page(block);
+	CHECK(harness::take_errors() == 1);
+
+	allocator->free_pages(block, HUGE_PAGE_ORDER);
+	allocator->free_huge_page(huge);
+	CHECK(harness::take_errors() == 0);
+
+	// Freeing a pool page twice is caught like any other double free.
+	allocator->free_huge_page(huge);
+	CHECK(harness::take_errors() == 1);
+
+	// The pool still holds both of its pages, and nothing more.
+	CHECK(allocator->allocate_huge_page() != NULL);
+	CHECK(allocator->allocate_huge_page() != NULL);
+	CHECK(allocator->allocate_huge_page() == NULL);
+	CHECK(allocator->nr_free_pages() == nr_pages - 2 * 512);
+}
+
+/** Returns TRUE if the captured log has a line that starts with the given text. */
+static bool log_has_line(const std::string& log, const std::string& text)
+{
+	return log.compare(0, text.size(), text) == 0 || log.find("\n" + text) != std::string::npos;
+}
+
+/** Returns the rest of every line of the captured log that starts with a prefix, joined up. */
+static std::string log_lines(const std::string& log, const std::string& prefix)
+{
+	std::string joined;
+
+	for (size_t start = 0; start < log.size(); start = log.find('\n', start) + 1) {
+		if (log.compare(start, prefix.size(), prefix) != 0) continue;
+
+		size_t end = log.find('\n', start);
+		joined += log.substr(start + prefix.size(), end - start - prefix.size());
+	}
+
+	return joined;
+}
+
+TEST(state_is_dumped_list_by_list)
+{
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// Splitting down to a single page leaves one free block of every order below the top.
+	PageDescriptor *pgd = allocator->allocate_pages(0);
+	CHECK(pfn_of(pgd) == 0);
+
+	harness::capture_log();
+	allocator->dump_state();
+	std::string log = harness::take_log();
+
+	CHECK(log_has_line(log, "BUDDY STATE:\n"));
+	CHECK(log_has_line(log, "free pages: 4095 (min 16, low 20, high 24)\n"));
+	CHECK(log_has_line(log, "blocks: [0]=1 [1]=1 [2]=1 [3]=1 [4]=1 [5]=1 [6]=1 [7]=1 [8]=1 [9]=1 [10]=1 [11]=1 [12]=0 "));
+	CHECK(log_has_line(log, "node 0 unmovable:\n[0] 1 \n[1] 2 \n[2] 4 \n"));
+	CHECK(log_has_line(log, "[11] 800 \n[12] \n"));
+
+	allocator->free_pages(pgd, 0);
+}
+
+TEST(long_free_lists_are_dumped_whole)
+{
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// Freeing every other page puts far more blocks on the order 0 list than are copied out
+	// under the lock at a time.
+	std::vector<PageDescriptor *> pages;
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) {
+		pages.push_back(pgd);
+	}
+
+	for (PageDescriptor *pgd : pages) {
+		if (pfn_of(pgd) % 2 == 0) allocator->free_pages(pgd, 0);
+	}
+
+	harness::capture_log();
+	allocator->dump_state();
+	std::string listed = log_lines(harness::take_log(), "[0] ");
+
+	// Every free page is listed once, however many lines it takes.
+	CHECK(std::count(listed.begin(), listed.end(), ' ') == nr_pages / 2);
+	CHECK(listed.find("(changed)") == std::string::npos);
+}
+
+TEST(compact_dump_is_run_length_encoded)
+{
+	harness::set_argument("pgalloc.dump", "compact");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// Two free runs either side of an allocated page.
+	PageDescriptor *first = allocator->allocate_pages(0);
+	PageDescriptor *second = allocator->allocate_pages(0);
+	CHECK(pfn_of(first) == 0 && pfn_of(second) == 1);
+	allocator->free_pages(first, 0);
+
+	harness::capture_log();
+	allocator->dump_state();
+	CHECK(log_has_line(harness::take_log(), "free: 0+1 2+ffe \n"));
+
+	// Then far more runs than are found under the locks at a time.
+	std::vector<PageDescriptor *> pages;
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) {
+		pages.push_back(pgd);
+	}
+
+	std::sort(pages.begin(), pages.end());
+
+	std::string expected;
+	for (PageDescriptor *pgd : pages) {
+		if (pfn_of(pgd) % 4 != 0) continue;
+
+		allocator->free_pages(pgd, 0);
+
+		char run[24];
+		snprintf(run, sizeof(run), "%lx+1 ", pfn_of(pgd));
+		expected += run;
+	}
+
+	harness::capture_log();
+	allocator->dump_state();
+	CHECK(log_lines(harness::take_log(), "free: ") == expected);
+}
+
+/** Allocates a page from a call site of its own, so its return address differs from any other. */
+static __attribute__((noinline)) PageDescriptor *allocate_traced_page(BuddyPageAllocator *allocator)
+{
+	PageDescriptor *pgd = allocator->allocate_pages(0);
+	asm volatile("");
+
+	return pgd;
+}
+
+TEST(trace_events_carry_their_own_caller)
+{
+	harness::set_argument("pgalloc.debug", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// The first allocation splits the top block all the way down; the second finds a page
+	// already free.  Every event, split or allocate, is recorded under the call that caused it.
+	uint64_t first_head = trace_ring.head;
+	PageDescriptor *first = allocate_traced_page(allocator);
+	uint64_t second_head = trace_ring.head;
+	PageDescriptor *second = allocator->allocate_pages(0);
+	uint64_t end_head = trace_ring.head;
+
+	CHECK(second_head - first_head == 13);
+	CHECK(end_head - second_head == 1);
+
+	const TraceEvent& first_alloc = trace_ring.events[second_head - 1];
+	const TraceEvent& second_alloc = trace_ring.events[end_head - 1];
+
+	CHECK(first_alloc.type == TRACE_ALLOCATE && first_alloc.pfn == pfn_of(first));
+	CHECK(second_alloc.type == TRACE_ALLOCATE && second_alloc.pfn == pfn_of(second));
+	CHECK(first_alloc.caller != second_alloc.caller);
+
+	for (uint64_t i = first_head; i < second_head - 1; i++) {
+		CHECK(trace_ring.events[i].type == TRACE_SPLIT);
+		CHECK(trace_ring.events[i].caller == first_alloc.caller);
+	}
+
+	// Frees that merge are recorded under the free, not the last allocation.
+	uint64_t free_head = trace_ring.head;
+	allocator->free_pages(second, 0);
+	allocator->free_pages(first, 0);
+
+	const TraceEvent& last_free = trace_ring.events[trace_ring.head - 1];
+	CHECK(last_free.type == TRACE_FREE && last_free.pfn == pfn_of(first));
+	CHECK(last_free.caller != first_alloc.caller && last_free.caller != second_alloc.caller);
+
+	for (uint64_t i = free_head; i < trace_ring.head; i++) {
+		if (trace_ring.events[i].type != TRACE_MERGE) continue;
+
+		// The merges come from one free or the other, never from an allocation.
+		CHECK(trace_ring.events[i].caller != first_alloc.caller);
+		CHECK(trace_ring.events[i].caller != second_alloc.caller);
+	}
+}
+
+TEST(trace_lines_decode)
+{
+	harness::set_argument("pgalloc.debug", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	PageDescriptor *first = allocate_traced_page(allocator);
+	PageDescriptor *second = allocator->allocate_pages(0);
+	allocator->free_pages(second, 0);
+	allocator->free_pages(first, 0);
+
+	// Write the ring out the way dump_trace() does, and run the decoder over it.
+	char path[] = "/tmp/pgtrace-XXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+
+	FILE *trace = fdopen(fd, "w");
+	for (uint64_t i = 0; i < trace_ring.head; i++) {
+		char line[96];
+		format_trace_event(trace_ring.events[i], line, sizeof(line));
+		fputs(line, trace);
+	}
+	fclose(trace);
+
+	// The decoder lives at the top of the tree, two levels above this binary.
+	char exe[4096];
+	ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	CHECK(length > 0);
+	exe[length] = 0;
+
+	std::string command = exe;
+	command = command.substr(0, command.rfind('/')) + "/../../decode-pgtrace.sh " + path;
+
+	FILE *decoder = popen(command.c_str(), "r");
+	CHECK(decoder != NULL);
+
+	std::string report;
+	char buffer[256];
+	while (fgets(buffer, sizeof(buffer), decoder)) report += buffer;
+
+	CHECK(pclose(decoder) == 0);
+	unlink(path);
+
+	// Two order-0 allocations and frees, the top block split all the way down and merged all the
+	// way back up, and every split put down to the first allocation's call site.
+	CHECK(log_has_line(report, "    0        2      0"));
+	CHECK(log_has_line(report, "   11        0      0          0          0        0          0          0        1        1\n"));
+	CHECK(log_has_line(report, "   12        0      0          0          0        0          0          0        1        0\n"));
+
+	// The first allocation's own event follows its twelve splits.
+	char splits[48];
+	snprintf(splits, sizeof(splits), "        12  %lx\n", trace_ring.events[12].caller);
+	CHECK(log_has_line(report, splits));
+}
+
+TEST(nodes_are_preferred)
+{
+	harness::set_argument("pgalloc.check", "1");
+	harness::set_argument("pgalloc.nodes", "4");
+
+	const uint64_t nr_pages = 4 << MAX_ORDER;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	for (unsigned int node = 0; node < 4; node++) {
+		PageDescriptor *pgd = allocator->allocate_pages_node(3, node);
+		CHECK(pgd != NULL);
+		CHECK(pfn_of(pgd) >> MAX_ORDER == node);
+
+		allocator->free_pages(pgd, 3);
+	}
+
+	CHECK(allocator->allocate_pages_node(0, 4) == NULL);
+}
+
+/** Reads the local and remote allocation counts out of the state dump. */
+static void node_stats(BuddyPageAllocator *allocator, uint64_t& nr_local, uint64_t& nr_remote)
+{
+	harness::capture_log();
+	allocator->dump_state();
+	std::string log = harness::take_log();
+
+	size_t line = log.find("[numa] ");
+	CHECK(line != std::string::npos);
+
+	unsigned int nr_nodes;
+	uint64_t node_size;
+	CHECK(sscanf(log.c_str() + line, "[numa] %u nodes of %lu pages, %lu local / %lu remote", &nr_nodes, &node_size, &nr_local, &nr_remote) == 4);
+}
+
+TEST(near_allocations_take_the_closest_block)
+{
+	harness::set_argument("pgalloc.nodes", "2");
+
+	// Nodes are at least a block of the largest order.
+	const uint64_t nr_pages = 2 << MAX_ORDER;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	std::vector<PageDescriptor *> pages(nr_pages);
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) {
+		pages[pfn_of(pgd)] = pgd;
+	}
+
+	// A few free pages on either node, and an aligned pair.
+	static const pfn_t free_pfns[] = { 100, 3000, 300000, 300002, 300003 };
+	for (pfn_t pfn : free_pfns) {
+		allocator->free_pages(pages[pfn], 0);
+	}
+
+	uint64_t nr_local, nr_remote;
+	node_stats(allocator, nr_local, nr_remote);
+
+	CHECK(pfn_of(allocator->allocate_pages_near(2990, 0)) == 3000);
+	CHECK(pfn_of(allocator->allocate_pages_near(120, 0)) == 100);
+	CHECK(pfn_of(allocator->allocate_pages_near(310000, 1)) == 300002);
+	CHECK(pfn_of(allocator->allocate_pages_near(280000, 0)) == 300000);
+
+	// With nothing left, the usual path has nothing either.
+	CHECK(allocator->allocate_pages_near(280000, 0) == NULL);
+
+	uint64_t nr_local_after, nr_remote_after;
+	node_stats(allocator, nr_local_after, nr_remote_after);
+	CHECK(nr_local_after == nr_local + 4);
+	CHECK(nr_remote_after == nr_remote);
+
+	// The only free page is on the other node from the hint.
+	allocator->free_pages(pages[50], 0);
+	CHECK(pfn_of(allocator->allocate_pages_near(400000, 0)) == 50);
+
+	node_stats(allocator, nr_local, nr_remote);
+	CHECK(nr_local == nr_local_after);
+	CHECK(nr_remote == nr_remote_after + 1);
+}
+
+TEST(near_allocations_fall_back_on_the_usual_path)
+{
+	harness::set_argument("pgalloc.check", "1");
+	harness::set_argument("pgalloc.pcp", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	std::vector<PageDescriptor *> pages(nr_pages);
+	while (PageDescriptor *pgd = allocator->allocate_pages(0)) {
+		pages[pfn_of(pgd)] = pgd;
+	}
+
+	// The only free page sits in the per-CPU cache, where the search for a nearby block cannot
+	// see it, so it is only found by falling back on the usual path, which drains the cache.
+	allocator->free_pages(pages[77], 0);
+	CHECK(allocator->nr_free_pages() == 0);
+	CHECK(allocator->nr_cached_pages() == 1);
+
+	CHECK(pfn_of(allocator->allocate_pages_near(4000, 0)) == 77);
+	CHECK(allocator->nr_cached_pages() == 0);
+	CHECK(allocator->allocate_pages_near(4000, 0) == NULL);
+}
+
+/**
+ * Churns random allocations and frees of mixed orders through a variant of the allocator, and
+ * checks that nothing is handed out twice and that everything coalesces back at the end.
+ */
+template<typename Allocator, int max_order>
+static void churn(const char *name)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 13;
+	Allocator *allocator = boot<Allocator>(name, nr_pages, nr_pages);
+
+	std::mt19937_64 rng(7);
+	std::vector<uint8_t> used(nr_pages);
+	std::vector<std::pair<PageDescriptor *, int>> live;
+
+	for (int i = 0; i < 20000; i++) {
+		if (live.empty() || rng() % 3) {
+			int order = rng() % 4 ? rng() % 3 : rng() % (max_order + 1);
+			PageDescriptor *pgd = rng() % 2 ? allocator->allocate_pages(order) : allocator->allocate_pages(order, (PageMobility)(rng() % NR_MOBILITY_TYPES));
+			if (!pgd) continue;
+
+			CHECK((pfn_of(pgd) & ((1ul << order) - 1)) == 0);
+			for (pfn_t pfn = pfn_of(pgd); pfn < pfn_of(pgd) + (1ul << order); pfn++) {
+				CHECK(!used[pfn]);
+				used[pfn] = 1;
+			}
+
+			live.push_back({ pgd, order });
+		} else {
+			size_t index = rng() % live.size();
+			auto block = live[index];
+			live[index] = live.back();
+			live.pop_back();
+
+			for (pfn_t pfn = pfn_of(block.first); pfn < pfn_of(block.first) + (1ul << block.second); pfn++) {
+				used[pfn] = 0;
+			}
+
+			allocator->free_pages(block.first, block.second);
+		}
+	}
+
+	for (auto& block : live) {
+		allocator->free_pages(block.first, block.second);
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, max_order) == nr_pages >> max_order);
+}
+
+TEST(lifo_variant_churns)
+{
+	churn<BuddyPageAllocator, MAX_ORDER>("buddy");
+}
+
+TEST(fifo_variant_churns)
+{
+	churn<BuddyFIFOPageAllocator, MAX_ORDER>("buddy-fifo");
+}
+
+TEST(ordered_variant_churns)
+{
+	churn<BuddyOrderedPageAllocator, MAX_ORDER>("buddy-ordered");
+}
+
+TEST(order10_variant_churns)
+{
+	churn<BuddySmallPageAllocator, 10>("buddy-order10");
+}
+
+TEST(ordered_allocations_take_the_lowest_block)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 12;
+	BuddyOrderedPageAllocator *allocator = boot<BuddyOrderedPageAllocator>("buddy-ordered", nr_pages, nr_pages);
+
+	PageDescriptor *pages[64];
+	for (int i = 0; i < 64; i++) {
+		pages[i] = allocator->allocate_pages(0);
+		CHECK(pfn_of(pages[i]) == (pfn_t)i);
+	}
+
+	// The hole left in the middle is filled before anything above it.
+	allocator->free_pages(pages[17], 0);
+	allocator->free_pages(pages[40], 0);
+	CHECK(allocator->allocate_pages(0) == pages[17]);
+	CHECK(allocator->allocate_pages(0) == pages[40]);
+
+	for (int i = 0; i < 64; i++) {
+		allocator->free_pages(pages[i], 0);
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+}
+
+/*
+ * A stand-in for the owner of movable memory: it knows which blocks it holds, and fills each
+ * with a pattern so that migration can be seen to have carried the contents along.
+ */
+static BuddyPageAllocator *migration_allocator;
+static std::vector<std::pair<PageDescriptor *, int>> owned_blocks;
+static unsigned int nr_migrations;
+
+static void fill_block(PageDescriptor *pgd, int order, uint8_t pattern)
+{
+	memset(harness::pgd_to_vpa(pgd), pattern, (1ul << order) << PAGE_SHIFT);
+}
+
+static bool block_holds(PageDescriptor *pgd, int order, uint8_t pattern)
+{
+	const uint8_t *bytes = (const uint8_t *)harness::pgd_to_vpa(pgd);
+	for (uint64_t i = 0; i < (1ul << order) << PAGE_SHIFT; i++) {
+		if (bytes[i] != pattern) return false;
+	}
+
+	return true;
+}
+
+static bool migrate_owned_block(PageDescriptor *from, PageDescriptor *to, int order)
+{
+	for (auto& block : owned_blocks) {
+		if (block.first != from) continue;
+		CHECK(block.second == order);
+
+		// Migration runs without the allocator's locks, so the migrator can allocate.
+		PageDescriptor *scratch = migration_allocator->allocate_pages(0);
+		CHECK(scratch != NULL);
+		migration_allocator->free_pages(scratch, 0);
+
+		memcpy(harness::pgd_to_vpa(to), harness::pgd_to_vpa(from), (1ul << order) << PAGE_SHIFT);
+		block.first = to;
+		nr_migrations++;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Fills memory with movable order-2 blocks, then frees every other one, leaving every
+ * pageblock half full and no free block bigger than order 2.
+ */
+static BuddyPageAllocator *boot_fragmented(uint64_t nr_pages)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+	migration_allocator = allocator;
+
+	std::vector<PageDescriptor *> blocks;
+	while (PageDescriptor *pgd = allocator->allocate_pages(2, MOBILITY_MOVABLE)) {
+		blocks.push_back(pgd);
+	}
+
+	CHECK(blocks.size() == nr_pages / 4);
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (i % 2) {
+			allocator->free_pages(blocks[i], 2);
+		} else {
+			fill_block(blocks[i], 2, i / 2 % 251);
+			owned_blocks.push_back({ blocks[i], 2 });
+		}
+	}
+
+	return allocator;
+}
+
+TEST(compaction_migrates_whole_blocks)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot_fragmented(nr_pages);
+
+	CHECK(allocator->allocate_pages(9, MOBILITY_MOVABLE) == NULL);
+
+	allocator->register_page_migrator(migrate_owned_block);
+
+	PageDescriptor *huge = allocator->allocate_pages(9, MOBILITY_MOVABLE);
+	CHECK(huge != NULL);
+	CHECK(nr_migrations == 256 / 4);
+
+	// Every block kept its contents, and none of them is inside the huge page.
+	for (size_t i = 0; i < owned_blocks.size(); i++) {
+		pfn_t pfn = pfn_of(owned_blocks[i].first);
+		CHECK((pfn & 3) == 0);
+		CHECK(pfn + 4 <= pfn_of(huge) || pfn >= pfn_of(huge) + 512);
+		CHECK(block_holds(owned_blocks[i].first, 2, i % 251));
+	}
+
+	// The migrated blocks are whole blocks of the order they were allocated with.
+	allocator->free_pages(huge, 9);
+	for (size_t i = 0; i < owned_blocks.size(); i++) {
+		if (i % 2) {
+			allocator->free_pages(owned_blocks[i].first, 2);
+		} else {
+			allocator->free_pages(owned_blocks[i].first);
+		}
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 13) == 1);
+}
+
+TEST(compaction_leaves_blocks_it_cannot_move)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot_fragmented(nr_pages);
+
+	// A migrator that refuses everything leaves every block where it was.
+	allocator->register_page_migrator([](PageDescriptor *from, PageDescriptor *to, int order) { return false; });
+	CHECK(allocator->allocate_pages(9, MOBILITY_MOVABLE) == NULL);
+
+	for (size_t i = 0; i < owned_blocks.size(); i++) {
+		CHECK(block_holds(owned_blocks[i].first, 2, i % 251));
+		allocator->free_pages(owned_blocks[i].first, 2);
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 13) == 1);
+}
+
+/* A migrator that finds the owner freeing each block out from under it. */
+static bool free_owned_block(PageDescriptor *from, PageDescriptor *to, int order)
+{
+	for (size_t i = 0; i < owned_blocks.size(); i++) {
+		if (owned_blocks[i].first != from) continue;
+
+		// The block is still being migrated, so the free has to wait for compaction.
+		uint64_t nr_free = migration_allocator->nr_free_pages();
+		migration_allocator->free_pages(from, order);
+		CHECK(migration_allocator->nr_free_pages() == nr_free);
+
+		owned_blocks.erase(owned_blocks.begin() + i);
+		nr_migrations++;
+		return false;
+	}
+
+	return false;
+}
+
+TEST(compaction_frees_blocks_freed_while_moving)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot_fragmented(nr_pages);
+
+	// Every block the owner frees mid-migration is freed once, by compaction, which is then
+	// left with an empty region.
+	allocator->register_page_migrator(free_owned_block);
+	PageDescriptor *huge = allocator->allocate_pages(9, MOBILITY_MOVABLE);
+	CHECK(huge != NULL);
+	CHECK(nr_migrations == 256 / 4);
+
+	allocator->free_pages(huge, 9);
+	for (auto& block : owned_blocks) {
+		allocator->free_pages(block.first, 2);
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+	CHECK(nr_allocatable(allocator, 13) == 1);
+}
+
+TEST(compaction_is_bounded_for_allocations)
+{
+	harness::set_argument("pgalloc.check", "1");
+
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+	migration_allocator = allocator;
+
+	// Three quarters of every pageblock is allocated, which is more than an allocation will
+	// wait to have migrated.
+	std::vector<PageDescriptor *> blocks;
+	while (PageDescriptor *pgd = allocator->allocate_pages(2, MOBILITY_MOVABLE)) {
+		blocks.push_back(pgd);
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (i % 4 == 3) {
+			allocator->free_pages(blocks[i], 2);
+		} else {
+			owned_blocks.push_back({ blocks[i], 2 });
+		}
+	}
+
+	// Filling memory up has started the reclaim daemon.
+	unsigned int daemon = harness::nr_threads();
+
+	allocator->register_page_migrator(migrate_owned_block);
+	CHECK(allocator->allocate_pages(9, MOBILITY_MOVABLE) == NULL);
+	CHECK(nr_migrations == 0);
+
+	// The request is left to the compaction daemon, which is started to deal with it.  Once
+	// it has gone to sleep, the next request wakes it rather than starting another.
+	CHECK(harness::nr_threads() == daemon + 1);
+	CHECK(harness::thread(daemon).state() == Thread::RUNNABLE);
+
+	harness::thread(daemon).sleep();
+	CHECK(allocator->allocate_pages(9, MOBILITY_MOVABLE) == NULL);
+	CHECK(harness::nr_threads() == daemon + 1);
+	CHECK(harness::thread(daemon).state() == Thread::RUNNABLE);
+	CHECK(harness::thread(daemon).nr_wake_ups() == 1);
+
+	for (auto& block : owned_blocks) {
+		allocator->free_pages(block.first, 2);
+	}
+
+	CHECK(allocator->nr_free_pages() == nr_pages);
+}
+
+static uint64_t shrink_nothing(uint64_t nr_pages)
+{
+	return 0;
+}
+
+TEST(reclaim_daemon_sleeps_until_woken)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+	allocator->register_shrinker(shrink_nothing);
+
+	// Dropping below the low watermark, but not the min one, starts the daemon.
+	uint64_t low = nr_pages / WATERMARK_MIN_RATIO * 5 / 4;
+	while (allocator->nr_free_pages() >= low) {
+		CHECK(harness::nr_threads() == 0);
+		allocator->allocate_pages(0);
+	}
+
+	CHECK(harness::nr_threads() == 1);
+
+	harness::thread(0).sleep();
+	allocator->allocate_pages(0);
+	CHECK(harness::nr_threads() == 1);
+	CHECK(harness::thread(0).state() == Thread::RUNNABLE);
+	CHECK(harness::thread(0).nr_wake_ups() == 1);
+}
+
+TEST(daemons_can_allocate_while_starting)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+	allocator->register_shrinker(shrink_nothing);
+	harness::set_thread_stacks(true);
+
+	// Allocating the daemon's stack takes free memory further below the low watermark, which
+	// must not start another daemon for the one being started.
+	uint64_t low = nr_pages / WATERMARK_MIN_RATIO * 5 / 4;
+	while (allocator->nr_free_pages() >= low) {
+		allocator->allocate_pages(0);
+	}
+
+	CHECK(harness::nr_threads() == 1);
+	CHECK(harness::thread(0).state() == Thread::RUNNABLE);
+	CHECK(allocator->nr_free_pages() == low - 2);
+}
+
+static unsigned int nr_shrinks;
+
+static uint64_t count_shrinks(uint64_t nr_pages)
+{
+	nr_shrinks++;
+	return 0;
+}
+
+TEST(direct_reclaim_backs_off)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+	allocator->register_shrinker(count_shrinks);
+
+	uint64_t min = nr_pages / WATERMARK_MIN_RATIO;
+	uint64_t low = min * 5 / 4;
+
+	std::vector<PageDescriptor *> pages;
+	while (allocator->nr_free_pages() >= min) {
+		pages.push_back(allocator->allocate_pages(0));
+	}
+
+	CHECK(nr_shrinks == 1);
+
+	// Once the shrinkers have nothing to give, allocations below min stop asking them.
+	for (int i = 0; i < 8; i++) {
+		pages.push_back(allocator->allocate_pages(0));
+	}
+
+	CHECK(nr_shrinks == 1);
+
+	// An allocation that leaves free memory over the low watermark lets the next shortage try
+	// again.
+	while (allocator->nr_free_pages() <= low) {
+		allocator->free_pages(pages.back(), 0);
+		pages.pop_back();
+	}
+
+	allocator->allocate_pages(0);
+	while (allocator->nr_free_pages() >= min) {
+		allocator->allocate_pages(0);
+	}
+
+	CHECK(nr_shrinks == 2);
+}
+
+TEST(zeroing_daemon_sleeps_until_woken)
+{
+	const uint64_t nr_pages = 1 << 13;
+	BuddyPageAllocator *allocator = boot(nr_pages, nr_pages);
+
+	// The daemon never runs on the host, so the pages are zeroed inline.
+	PageDescriptor *pgd = allocator->allocate_pages(2);
+	memset(harness::pgd_to_vpa(pgd), 0xa5, 4 << PAGE_SHIFT);
+	allocator->free_pages(pgd, 2);
+
+	pgd = allocator->allocate_zeroed_pages(2);
+	CHECK(harness::nr_threads() == 1);
+
+	const uint8_t *bytes = (const uint8_t *)harness::pgd_to_vpa(pgd);
+	for (uint64_t i = 0; i < (4 << PAGE_SHIFT); i++) {
+		CHECK(bytes[i] == 0);
+	}
+
+	// Taking another zeroed block wakes the daemon to top the pool up again.
+	harness::thread(0).sleep();
+	allocator->allocate_zeroed_pages(0);
+	CHECK(harness::nr_threads() == 1);
+	CHECK(harness::thread(0).state() == Thread::RUNNABLE);
+	CHECK(harness::thread(0).nr_wake_ups() == 1);
+}
+
+int main(int argc, char **argv)
+{
+	return harness::run_tests(argc, argv);
+}
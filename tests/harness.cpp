@@ -0,0 +1,352 @@
+/*
+ * Host Test Harness
+ *
+ * The stand-ins for the kernel the allocator runs against, and the test runner.
+ */
+
+#include "harness.h"
+
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/process.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/log.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+
+infos::kernel::Kernel sys;
+infos::kernel::ComponentLog mm_log;
+
+/* The memory behind the descriptors is aligned to the largest block, as it would be physically. */
+#define MEMORY_ALIGN	(1ul << 30)
+
+#define MAX_ARGUMENTS	32
+#define MAX_ALGORITHMS	16
+#define MAX_THREADS	16
+
+static struct { const char *key; CmdLineArgumentHandler handler; } arguments[MAX_ARGUMENTS];
+static unsigned int nr_arguments;
+
+static PageAllocatorAlgorithm *algorithms[MAX_ALGORITHMS];
+static unsigned int nr_algorithms;
+
+static Thread *threads[MAX_THREADS];
+static unsigned int nr_threads_created;
+static bool allocate_thread_stacks;
+
+static Process kernel_process_instance;
+
+static PageDescriptor *descriptors;
+static uint8_t *memory;
+
+static const char *algorithm_name = "buddy";
+static uint64_t nr_errors;
+static bool verbose;
+static bool capturing;
+static std::string captured_log;
+
+static harness::TestCase *test_cases;
+static const char *current_test;
+
+CmdLineArgumentRegistration::CmdLineArgumentRegistration(const char *key, CmdLineArgumentHandler handler)
+{
+	if (nr_arguments < MAX_ARGUMENTS) {
+		arguments[nr_arguments].key = key;
+		arguments[nr_arguments].handler = handler;
+		nr_arguments++;
+	}
+}
+
+PageAllocatorRegistration::PageAllocatorRegistration(PageAllocatorAlgorithm *algorithm)
+{
+	if (nr_algorithms < MAX_ALGORITHMS) {
+		algorithms[nr_algorithms++] = algorithm;
+	}
+}
+
+void ComponentLog::messagef(LogLevel::LogLevel level, const char *fmt, ...)
+{
+	if (level >= LogLevel::ERROR) nr_errors++;
+
+	if (capturing) {
+		char message[256];
+
+		va_list args;
+		va_start(args, fmt);
+		vsnprintf(message, sizeof(message), fmt, args);
+		va_end(args);
+
+		captured_log += message;
+		captured_log += "\n";
+	}
+
+	if (level < LogLevel::WARNING && !verbose) return;
+
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+
+	printf("\n");
+}
+
+Process& Kernel::kernel_process()
+{
+	return kernel_process_instance;
+}
+
+Thread& Process::create_thread(ThreadPrivilege::ThreadPrivilege privilege, Thread::thread_proc_t entry_point)
+{
+	if (nr_threads_created >= MAX_THREADS) {
+		fprintf(stderr, "harness: out of threads\n");
+		abort();
+	}
+
+	// The kernel allocates a stack for every thread it creates, which can land back in the
+	// allocator that asked for the thread.
+	if (allocate_thread_stacks) {
+		sys.mm().pgalloc().alloc_pages(0);
+	}
+
+	Thread *thread = new Thread(entry_point);
+	threads[nr_threads_created++] = thread;
+
+	return *thread;
+}
+
+bool harness::set_argument(const char *key, const char *value)
+{
+	bool found = false;
+
+	for (unsigned int i = 0; i < nr_arguments; i++) {
+		if (strcmp(arguments[i].key, key) == 0) {
+			arguments[i].handler(value);
+			found = true;
+		}
+	}
+
+	// The allocator itself is picked by name, as the kernel does it.
+	if (strcmp(key, "pgalloc.algorithm") == 0) {
+		algorithm_name = value;
+		found = true;
+	}
+
+	return found;
+}
+
+int harness::parse_arguments(int argc, char **argv)
+{
+	int nr_left = 0;
+
+	for (int i = 0; i < argc; i++) {
+		char *equals = strchr(argv[i], '=');
+		if (!equals) {
+			argv[nr_left++] = argv[i];
+			continue;
+		}
+
+		*equals = 0;
+		if (!set_argument(argv[i], equals + 1)) {
+			fprintf(stderr, "harness: unknown argument '%s'\n", argv[i]);
+			exit(2);
+		}
+	}
+
+	return nr_left;
+}
+
+static void map_memory()
+{
+	if (descriptors) return;
+
+	descriptors = (PageDescriptor *)mmap(NULL, HARNESS_MAX_PAGES * sizeof(PageDescriptor),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	// Only what is touched is ever backed, so this costs nothing up front.
+	uint8_t *mapping = (uint8_t *)mmap(NULL, (HARNESS_MAX_PAGES << 12) + MEMORY_ALIGN,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (descriptors == MAP_FAILED || mapping == MAP_FAILED) {
+		perror("harness: mmap");
+		exit(2);
+	}
+
+	memory = (uint8_t *)(((uintptr_t)mapping + MEMORY_ALIGN - 1) & ~(MEMORY_ALIGN - 1));
+}
+
+PageAllocatorAlgorithm *harness::boot(const char *algorithm, uint64_t nr_pages, uint64_t nr_usable)
+{
+	PageAllocatorAlgorithm *selected = NULL;
+	for (unsigned int i = 0; i < nr_algorithms; i++) {
+		if (strcmp(algorithms[i]->name(), algorithm) == 0) {
+			selected = algorithms[i];
+		}
+	}
+
+	if (!selected) return NULL;
+
+	map_memory();
+	sys.mm().pgalloc().setup(descriptors, memory, selected);
+
+	// A fresh boot forgets the kernel threads the last one started.
+	for (unsigned int i = 0; i < nr_threads_created; i++) {
+		delete threads[i];
+	}
+
+	nr_threads_created = 0;
+
+	if (!selected->init(descriptors, nr_pages)) return NULL;
+	if (nr_usable) selected->insert_page_range(descriptors, nr_usable);
+
+	return selected;
+}
+
+const char *harness::algorithm()
+{
+	return algorithm_name;
+}
+
+PageDescriptor *harness::pfn_to_pgd(pfn_t pfn)
+{
+	return &descriptors[pfn];
+}
+
+pfn_t harness::pgd_to_pfn(const PageDescriptor *pgd)
+{
+	return pgd - descriptors;
+}
+
+void *harness::pgd_to_vpa(const PageDescriptor *pgd)
+{
+	return memory + ((uint64_t)(pgd - descriptors) << 12);
+}
+
+uint64_t harness::take_errors()
+{
+	uint64_t count = nr_errors;
+	nr_errors = 0;
+
+	return count;
+}
+
+void harness::set_verbose(bool enabled)
+{
+	verbose = enabled;
+}
+
+void harness::capture_log()
+{
+	capturing = true;
+	captured_log.clear();
+}
+
+std::string harness::take_log()
+{
+	std::string log;
+	log.swap(captured_log);
+
+	return log;
+}
+
+unsigned int harness::nr_threads()
+{
+	return nr_threads_created;
+}
+
+Thread& harness::thread(unsigned int index)
+{
+	return *threads[index];
+}
+
+void harness::set_thread_stacks(bool allocate)
+{
+	allocate_thread_stacks = allocate;
+}
+
+uint64_t harness::now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+harness::TestCase::TestCase(const char *name, void (*fn)()) : name(name), fn(fn), next(NULL)
+{
+	// Keep the tests in the order they appear in the file.
+	TestCase **tail = &test_cases;
+	while (*tail) tail = &(*tail)->next;
+	*tail = this;
+}
+
+void harness::fail(const char *file, int line, const char *what)
+{
+	printf("%s: %s:%d: CHECK(%s) failed\n", current_test, file, line, what);
+	fflush(stdout);
+	_exit(1);
+}
+
+static bool selected(const harness::TestCase *test, int argc, char **argv)
+{
+	if (argc == 0) return true;
+
+	for (int i = 0; i < argc; i++) {
+		if (strstr(test->name, argv[i])) return true;
+	}
+
+	return false;
+}
+
+int harness::run_tests(int argc, char **argv)
+{
+	argc = parse_arguments(argc - 1, argv + 1);
+
+	unsigned int nr_run = 0, nr_failed = 0;
+	for (TestCase *test = test_cases; test; test = test->next) {
+		if (!selected(test, argc, argv + 1)) continue;
+
+		fflush(stdout);
+		uint64_t start = now_ns();
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			current_test = test->name;
+			test->fn();
+
+			uint64_t errors = take_errors();
+			if (errors) {
+				printf("%s: %lu unexpected errors logged\n", test->name, errors);
+				fflush(stdout);
+				_exit(1);
+			}
+
+			fflush(stdout);
+			_exit(0);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+
+		bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		if (!passed && WIFSIGNALED(status)) {
+			printf("%s: killed by signal %d\n", test->name, WTERMSIG(status));
+		}
+
+		printf("%-6s %s (%lu ms)\n", passed ? "ok" : "FAIL", test->name, (now_ns() - start) / 1000000);
+
+		nr_run++;
+		if (!passed) nr_failed++;
+	}
+
+	printf("%u of %u tests passed\n", nr_run - nr_failed, nr_run);
+	return nr_failed ? 1 : 0;
+}
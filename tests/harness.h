@@ -0,0 +1,116 @@
+/*
+ * Host Test Harness
+ *
+ * Just enough of the kernel for the page allocator (coursework/buddy.cpp) and the slab caches
+ * on top of it to be built and driven as an ordinary program.  Each test or benchmark includes
+ * the allocator's source directly, so it can get at the file-scope tables as well as the public
+ * interface, and links against harness.cpp for the stand-ins.
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+#include <infos/kernel/thread.h>
+
+#include <string>
+
+/* The most page frames the harness has descriptors and memory for: 8 GiB worth of 4 KiB pages. */
+#define HARNESS_MAX_PAGES	(1ul << 21)
+
+namespace harness
+{
+	using infos::mm::PageAllocatorAlgorithm;
+	using infos::mm::PageDescriptor;
+	using infos::mm::pfn_t;
+
+	/**
+	 * Hands a value to the handler of a kernel command-line argument, as if it had been passed at
+	 * boot.
+	 * @return Returns TRUE if there is a handler for the argument, FALSE otherwise.
+	 */
+	bool set_argument(const char *key, const char *value);
+
+	/**
+	 * Applies every "key=value" argument in argv as a command-line argument, and compacts the
+	 * rest down to the front of argv.
+	 * @return Returns the number of arguments left.
+	 */
+	int parse_arguments(int argc, char **argv);
+
+	/**
+	 * Initialises the named allocator for nr_pages page frames, and makes the first nr_usable of
+	 * them available.  Frames up to HARNESS_MAX_PAGES have descriptors and memory behind them, so
+	 * anything beyond nr_pages can be hot-added later.  The kernel threads of any earlier boot
+	 * are forgotten.
+	 * @return Returns the allocator, or NULL if there is no allocator by that name.
+	 */
+	PageAllocatorAlgorithm *boot(const char *algorithm, uint64_t nr_pages, uint64_t nr_usable);
+
+	/** Returns the name of the allocator the current test or benchmark should use. */
+	const char *algorithm();
+
+	/** Returns the descriptor of the given page frame. */
+	PageDescriptor *pfn_to_pgd(pfn_t pfn);
+
+	/** Returns the page frame of the given descriptor. */
+	pfn_t pgd_to_pfn(const PageDescriptor *pgd);
+
+	/** Returns the memory described by the given descriptor. */
+	void *pgd_to_vpa(const PageDescriptor *pgd);
+
+	/** Returns the number of errors logged since the last call, and starts counting again. */
+	uint64_t take_errors();
+
+	/** Shows (or hides) the allocator's debug and info messages. */
+	void set_verbose(bool verbose);
+
+	/** Starts keeping every message logged, whatever its level, for take_log(). */
+	void capture_log();
+
+	/** Returns the messages logged since the last call, one per line, and starts again. */
+	std::string take_log();
+
+	/** Returns the kernel threads created so far, in the order they were created. */
+	unsigned int nr_threads();
+	infos::kernel::Thread& thread(unsigned int index);
+
+	/**
+	 * Has every kernel thread created from now on allocate a page for its stack from the
+	 * allocator, as creating a thread in the kernel does.
+	 */
+	void set_thread_stacks(bool allocate);
+
+	/** Returns a monotonic time in nanoseconds. */
+	uint64_t now_ns();
+
+	/**
+	 * A test case, run by run_tests() in a process of its own so that the allocator's file-scope
+	 * state and the command-line arguments start afresh for every test.
+	 */
+	struct TestCase
+	{
+		TestCase(const char *name, void (*fn)());
+
+		const char *name;
+		void (*fn)();
+		TestCase *next;
+	};
+
+	/**
+	 * Runs every test case whose name contains one of the arguments (or all of them, if there are
+	 * none), after applying any "key=value" arguments.  A test fails if a CHECK fails, or if it
+	 * leaves errors in the log that it did not take.
+	 * @return Returns the process exit code.
+	 */
+	int run_tests(int argc, char **argv);
+
+	/** Reports a failed check, and ends the test. */
+	[[noreturn]] void fail(const char *file, int line, const char *what);
+}
+
+#define TEST(_name) \
+	static void test_##_name(); \
+	static harness::TestCase __test_case_##_name(#_name, test_##_name); \
+	static void test_##_name()
+
+#define CHECK(_cond) \
+	do { if (!(_cond)) harness::fail(__FILE__, __LINE__, #_cond); } while (0)
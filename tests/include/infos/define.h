@@ -0,0 +1,10 @@
+/*
+ * Host stand-in for <infos/define.h>.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#define __section(s) __attribute__((section(s)))
@@ -0,0 +1,23 @@
+/*
+ * Host stand-in for <infos/kernel/cmdline.h>.  Arguments are handed to their handlers by
+ * harness::set_argument(), rather than being parsed out of a boot command-line.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos {
+	namespace kernel {
+		typedef void (*CmdLineArgumentHandler)(const char *value);
+
+		struct CmdLineArgumentRegistration
+		{
+			CmdLineArgumentRegistration(const char *key, CmdLineArgumentHandler handler);
+		};
+	}
+}
+
+#define RegisterCmdLineArgument(_name, _key) \
+	static void __cmdline_arg_handler_##_name(const char *value); \
+	static infos::kernel::CmdLineArgumentRegistration __cmdline_arg_##_name(_key, __cmdline_arg_handler_##_name); \
+	static void __cmdline_arg_handler_##_name(const char *value)
@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for <infos/kernel/kernel.h>.
+ */
+#pragma once
+
+#include <infos/mm/mm.h>
+
+namespace infos {
+	namespace kernel {
+		class Process;
+
+		class Kernel
+		{
+		public:
+			mm::MemoryManager& mm() { return _mm; }
+			Process& kernel_process();
+
+		private:
+			mm::MemoryManager _mm;
+		};
+	}
+}
+
+extern infos::kernel::Kernel sys;
@@ -0,0 +1,23 @@
+/*
+ * Host stand-in for <infos/kernel/log.h>.
+ *
+ * Messages go to stdout.  Errors are always shown, and counted so that tests can tell when the
+ * allocator has complained; everything else is only shown when the harness is verbose.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos {
+	namespace kernel {
+		namespace LogLevel {
+			enum LogLevel { DEBUG, INFO, WARNING, ERROR, FATAL };
+		}
+
+		class ComponentLog
+		{
+		public:
+			void messagef(LogLevel::LogLevel level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+		};
+	}
+}
@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for <infos/kernel/process.h>.
+ */
+#pragma once
+
+#include <infos/kernel/thread.h>
+
+namespace infos {
+	namespace kernel {
+		class Process
+		{
+		public:
+			Thread& create_thread(ThreadPrivilege::ThreadPrivilege privilege, Thread::thread_proc_t entry_point);
+		};
+	}
+}
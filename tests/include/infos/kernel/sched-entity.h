@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for <infos/kernel/sched-entity.h>.
+ */
+#pragma once
+
+namespace infos {
+	namespace kernel {
+		namespace SchedulingEntityPriority {
+			enum SchedulingEntityPriority { REALTIME, INTERACTIVE, NORMAL, DAEMON, IDLE };
+		}
+	}
+}
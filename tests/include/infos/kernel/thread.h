@@ -0,0 +1,47 @@
+/*
+ * Host stand-in for <infos/kernel/thread.h>.
+ *
+ * Kernel threads are never actually run on the host: the harness only keeps track of the state
+ * each one has been put in, so that tests can see that a daemon was started or woken.
+ */
+#pragma once
+
+#include <infos/kernel/sched-entity.h>
+
+namespace infos {
+	namespace kernel {
+		namespace ThreadPrivilege {
+			enum ThreadPrivilege { User, Kernel };
+		}
+
+		class Thread
+		{
+		public:
+			typedef void (*thread_proc_t)(void *);
+
+			enum State { CREATED, RUNNABLE, SLEEPING };
+
+			Thread(thread_proc_t entry_point) : _entry_point(entry_point), _state(CREATED), _nr_wake_ups(0) { }
+
+			void priority(SchedulingEntityPriority::SchedulingEntityPriority priority) { }
+
+			void start() { _state = RUNNABLE; }
+			void sleep() { _state = SLEEPING; }
+
+			void wake_up()
+			{
+				if (_state == SLEEPING) _state = RUNNABLE;
+				_nr_wake_ups++;
+			}
+
+			thread_proc_t entry_point() const { return _entry_point; }
+			State state() const { return _state; }
+			unsigned int nr_wake_ups() const { return _nr_wake_ups; }
+
+		private:
+			thread_proc_t _entry_point;
+			State _state;
+			unsigned int _nr_wake_ups;
+		};
+	}
+}
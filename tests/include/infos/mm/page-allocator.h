@@ -0,0 +1,71 @@
+/*
+ * Host stand-in for <infos/mm/page-allocator.h>.
+ *
+ * Page descriptors live in one array, and the memory they describe in one mapping, both set up
+ * by harness::boot().  Allocator algorithms register themselves with the harness, which picks
+ * one by name the way pgalloc.algorithm does.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos {
+	namespace mm {
+		typedef uint64_t pfn_t;
+
+		struct PageDescriptor
+		{
+			PageDescriptor *next_free;
+		};
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *allocate_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual void insert_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual void remove_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator
+		{
+		public:
+			PageAllocator() : _descriptors(NULL), _memory(NULL), _algorithm(NULL) { }
+
+			void setup(PageDescriptor *descriptors, uint8_t *memory, PageAllocatorAlgorithm *algorithm)
+			{
+				_descriptors = descriptors;
+				_memory = memory;
+				_algorithm = algorithm;
+			}
+
+			pfn_t pgd_to_pfn(const PageDescriptor *pgd) const { return (pfn_t)(pgd - _descriptors); }
+			PageDescriptor *pfn_to_pgd(pfn_t pfn) const { return &_descriptors[pfn]; }
+			void *pgd_to_vpa(const PageDescriptor *pgd) const { return _memory + (pgd_to_pfn(pgd) << 12); }
+
+			PageDescriptor *alloc_pages(int order) { return _algorithm->allocate_pages(order); }
+			void free_pages(PageDescriptor *pgd, int order) { _algorithm->free_pages(pgd, order); }
+
+			PageAllocatorAlgorithm& algorithm() const { return *_algorithm; }
+
+		private:
+			PageDescriptor *_descriptors;
+			uint8_t *_memory;
+			PageAllocatorAlgorithm *_algorithm;
+		};
+
+		struct PageAllocatorRegistration
+		{
+			PageAllocatorRegistration(PageAllocatorAlgorithm *algorithm);
+		};
+	}
+}
+
+#define RegisterPageAllocator(_class) \
+	static _class __pgalloc_##_class; \
+	static infos::mm::PageAllocatorRegistration __pgalloc_registration_##_class(&__pgalloc_##_class)
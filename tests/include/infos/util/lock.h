@@ -0,0 +1,19 @@
+/*
+ * Host stand-in for <infos/util/lock.h>.
+ *
+ * There are no interrupts on the host, so holding one of these does nothing.  Code that relies
+ * on it for mutual exclusion (the per-CPU page cache, the pools) must not be driven from more
+ * than one host thread at a time.
+ */
+#pragma once
+
+namespace infos {
+	namespace util {
+		class UniqueIRQLock
+		{
+		public:
+			UniqueIRQLock() { }
+			~UniqueIRQLock() { }
+		};
+	}
+}
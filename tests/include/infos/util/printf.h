@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for <infos/util/printf.h>.
+ */
+#pragma once
+
+#include <stdio.h>
@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for <infos/util/string.h>.
+ */
+#pragma once
+
+#include <string.h>
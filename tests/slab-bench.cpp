@@ -0,0 +1,80 @@
+/*
+ * Slab Object Cache Benchmarks
+ *
+ * Small-object throughput through the object caches, against taking a whole page from the
+ * buddy allocator for every object.
+ * Usage: slab-bench [pgalloc.<argument>=<value>...]
+ */
+
+#include "harness.h"
+#include "../coursework/buddy.cpp"
+#include "../coursework/slab.h"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+
+/* How many times each measurement is repeated; the best run is reported. */
+#define BENCH_REPEATS	5
+
+static void report(const char *name, uint64_t nr_ops, uint64_t ns)
+{
+	printf("%-32s %10lu ops %10.1f ns/op %12.0f ops/s\n", name, nr_ops, (double)ns / nr_ops, nr_ops * 1e9 / ns);
+}
+
+/*
+ * Allocates a batch of objects and frees them again in a shuffled order, either through the
+ * object caches or a page at a time.
+ */
+static void bench_objects(uint64_t size, bool use_slab)
+{
+	const uint64_t nr_pages = 1 << 16;
+	const uint64_t nr_objects = 1 << 14;
+	const uint64_t nr_rounds = 16;
+
+	uint64_t best = ~0ul;
+	std::vector<void *> objects(nr_objects);
+
+	for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+		PageAllocatorAlgorithm *allocator = harness::boot("buddy", nr_pages, nr_pages);
+		std::mt19937_64 rng(size);
+
+		uint64_t start = harness::now_ns();
+
+		for (uint64_t round = 0; round < nr_rounds; round++) {
+			for (uint64_t i = 0; i < nr_objects; i++) {
+				objects[i] = use_slab ? slab_alloc(size) : allocator->allocate_pages(0);
+			}
+
+			std::shuffle(objects.begin(), objects.end(), rng);
+
+			for (uint64_t i = 0; i < nr_objects; i++) {
+				if (use_slab) {
+					slab_free(objects[i]);
+				} else {
+					allocator->free_pages((PageDescriptor *)objects[i], 0);
+				}
+			}
+		}
+
+		best = std::min(best, harness::now_ns() - start);
+		slab_reap();
+	}
+
+	char name[48];
+	snprintf(name, sizeof(name), "%s/size:%lu", use_slab ? "slab" : "pages", size);
+	report(name, 2 * nr_rounds * nr_objects, best);
+}
+
+int main(int argc, char **argv)
+{
+	harness::parse_arguments(argc - 1, argv + 1);
+
+	static const uint64_t sizes[] = { 16, 64, 256, 1024 };
+	for (uint64_t size : sizes) {
+		bench_objects(size, true);
+		bench_objects(size, false);
+	}
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Slab Object Cache Tests
+ *
+ * Correctness tests for the object caches, run on the host against the kernel stand-ins, on top
+ * of the standard buddy allocator.
+ */
+
+#include "harness.h"
+#include "../coursework/buddy.cpp"
+#include "../coursework/slab.h"
+
+#include <vector>
+
+/* Pages in each slab, as laid down in slab.cpp. */
+static const uint64_t slab_pages = 4;
+
+static BuddyPageAllocator *boot(uint64_t nr_pages)
+{
+	PageAllocatorAlgorithm *allocator = harness::boot("buddy", nr_pages, nr_pages);
+	CHECK(allocator != NULL);
+
+	return static_cast<BuddyPageAllocator *>(allocator);
+}
+
+TEST(objects_do_not_overlap)
+{
+	const uint64_t nr_pages = 1 << 12;
+	boot(nr_pages);
+
+	ObjectCache cache("test", 48);
+
+	std::vector<uint8_t *> objects;
+	for (int i = 0; i < 2000; i++) {
+		uint8_t *object = (uint8_t *)cache.allocate();
+		CHECK(object != NULL);
+		CHECK(ObjectCache::cache_of(object) == &cache);
+
+		memset(object, i & 0xff, 48);
+		objects.push_back(object);
+	}
+
+	for (int i = 0; i < 2000; i++) {
+		for (int byte = 0; byte < 48; byte++) {
+			CHECK(objects[i][byte] == (i & 0xff));
+		}
+	}
+
+	for (uint8_t *object : objects) {
+		cache.free(object);
+	}
+}
+
+TEST(full_magazines_are_bounded)
+{
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages);
+
+	ObjectCache cache("test", 64);
+
+	std::vector<void *> objects;
+	for (int i = 0; i < 10000; i++) {
+		objects.push_back(cache.allocate());
+	}
+
+	CHECK(allocator->nr_free_pages() < nr_pages - 100);
+
+	// Only a bounded number of freed objects stay in magazines, and the slabs the rest lived in
+	// go back to the page allocator.
+	for (void *object : objects) {
+		cache.free(object);
+	}
+
+	CHECK(allocator->nr_free_pages() >= nr_pages - 8 * slab_pages);
+
+	cache.reap();
+	CHECK(allocator->nr_free_pages() >= nr_pages - 2 * slab_pages);
+}
+
+TEST(caches_are_reaped_when_memory_runs_out)
+{
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages);
+
+	std::vector<void *> objects;
+	for (int i = 0; i < 2000; i++) {
+		objects.push_back(slab_alloc(i % 2 ? 200 : 24));
+	}
+
+	for (void *object : objects) {
+		slab_free(object);
+	}
+
+	CHECK(allocator->nr_free_pages() < nr_pages);
+
+	// The caches register themselves with the buddy allocator as a shrinker, so every page they
+	// were holding on to can still be allocated.
+	uint64_t nr_allocated = 0;
+	while (allocator->allocate_pages(0)) {
+		nr_allocated++;
+	}
+
+	CHECK(nr_allocated == nr_pages);
+}
+
+TEST(shrinking_stops_when_enough_is_freed)
+{
+	const uint64_t nr_pages = 1 << 12;
+	BuddyPageAllocator *allocator = boot(nr_pages);
+
+	// Leave empty slabs behind in two caches.
+	std::vector<void *> objects;
+	for (int i = 0; i < 2000; i++) {
+		objects.push_back(slab_alloc(i % 2 ? 2048 : 16));
+	}
+
+	for (void *object : objects) {
+		slab_free(object);
+	}
+
+	uint64_t nr_held = nr_pages - allocator->nr_free_pages();
+
+	// Asking for a single page reaps the 16-byte cache, and leaves the 2048-byte one alone.
+	uint64_t nr_freed = slab_shrink(1);
+	CHECK(nr_freed >= 1);
+	CHECK(nr_freed < nr_held);
+	CHECK(allocator->nr_free_pages() == nr_pages - nr_held + nr_freed);
+
+	CHECK(slab_shrink(nr_pages) == nr_held - nr_freed);
+	CHECK(allocator->nr_free_pages() == nr_pages);
+}
+
+int main(int argc, char **argv)
+{
+	return harness::run_tests(argc, argv);
+}